@@ -0,0 +1,89 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_BATCH_H_
+#define _XENIFACE_BATCH_H_
+
+#include <string>
+#include <vector>
+typedef std::string                 String;
+typedef std::vector< std::string >  StringVct;
+
+// store operations queued up and applied together by XenIfaceItf::Flush
+class XenIfaceBatch
+{
+public:
+    void      Write(const String& path, const String& value)
+    {
+        Op op = { false, path, value };
+        m_ops.push_back(op);
+    }
+    void      Remove(const String& path)
+    {
+        Op op = { true, path, String() };
+        m_ops.push_back(op);
+    }
+    size_t    Count() const
+    {
+        return m_ops.size();
+    }
+    void      Clear()
+    {
+        m_ops.clear();
+    }
+
+    // applies the operations in order through itf's TryWrite and TryRemove,
+    // stopping at the first failure, which is returned
+    template <class Itf>
+    HRESULT   Apply(Itf& itf) const
+    {
+        HRESULT     hr(S_OK);
+
+        for (size_t i = 0; i < m_ops.size() && SUCCEEDED(hr); ++i) {
+            const Op& op = m_ops[i];
+            if (op.remove)
+                hr = itf.TryRemove(op.path);
+            else
+                hr = itf.TryWrite(op.path, op.value);
+        }
+        return hr;
+    }
+
+private:
+    struct Op {
+        bool    remove;
+        String  path;
+        String  value;
+    };
+    std::vector<Op> m_ops;
+};
+
+#endif // _XENIFACE_BATCH_H_
@@ -36,10 +36,7 @@
 
 #include "xeniface_ioctls.h"
 
-#include <string>
-#include <vector>
-typedef std::string                 String;
-typedef std::vector< std::string >  StringVct;
+#include "xeniface_batch.h"
 
 #include <setupapi.h>
 #pragma comment (lib , "setupapi.lib" )
@@ -65,7 +62,247 @@ static void ____DebugPrint(const char* fmt, ...)
 class XenIfaceItf
 {
 public:
-    XenIfaceItf() : m_handle(INVALID_HANDLE_VALUE)
+    XenIfaceItf() : m_handle(INVALID_HANDLE_VALUE), m_generation(0), m_queries(0), m_queryIoctls(0)
+    {
+        InitializeCriticalSection(&m_lock);
+        Open();
+    }
+    ~XenIfaceItf() 
+    {
+        Close();
+        DeleteCriticalSection(&m_lock);
+    }
+
+    // process-wide connection, shared by every caller until the last Release
+    static XenIfaceItf* Acquire()
+    {
+        XenIfaceItf*    itf;
+        XenIfaceItf*    spare(NULL);
+
+        AcquireSRWLockExclusive(SharedLock());
+        if (SharedItf() == NULL) {
+            // Open takes SharedLock for the device path, so connect outside it
+            ReleaseSRWLockExclusive(SharedLock());
+            spare = new XenIfaceItf();
+            AcquireSRWLockExclusive(SharedLock());
+            if (SharedItf() == NULL) {
+                SharedItf() = spare;
+                spare = NULL;
+            }
+        }
+        ++SharedRefs();
+        itf = SharedItf();
+        ReleaseSRWLockExclusive(SharedLock());
+
+        // another caller connected first
+        delete spare;
+        return itf;
+    }
+    static void Release(XenIfaceItf* itf)
+    {
+        AcquireSRWLockExclusive(SharedLock());
+        if (itf == SharedItf() && --SharedRefs() == 0) {
+            delete SharedItf();
+            SharedItf() = NULL;
+        }
+        ReleaseSRWLockExclusive(SharedLock());
+    }
+
+    String    Read(const String& path)
+    {
+        String      value;
+
+        ThrowIfFailed(TryRead(path, &value));
+        return value;
+    }
+    void      Write(const String& path, const String& value) 
+    {
+        ThrowIfFailed(TryWrite(path, value));
+    }
+    void      Remove(const String& path) 
+    {
+        ThrowIfFailed(TryRemove(path));
+    }
+    StringVct Directory(const String& path) 
+    {
+        StringVct   values;
+
+        ThrowIfFailed(TryDirectory(path, &values));
+        return values;
+    }
+
+    // as above, but failures (including a missing key) are returned rather
+    // than thrown, for callers that expect them
+    HRESULT   TryRead(const String& path, String* value)
+    {
+        Lock        lock(m_lock);
+        DWORD       bytes;
+        HRESULT     hr;
+
+        DebugPrint(("XenIfaceItf: Read \"%s\"\n", (const char*)path.c_str()));
+        hr = Query(IOCTL_XENIFACE_STORE_READ, path, &bytes);
+        if (FAILED(hr))
+            return hr;
+
+        value->assign(&m_buffer[0], strnlen(&m_buffer[0], bytes));
+        DebugPrint(("XenIfaceItf: Read \"%s\" => \"%s\"\n", (const char*)path.c_str(), (const char*)value->c_str()));
+        return S_OK;
+    }
+    HRESULT   TryWrite(const String& path, const String& value)
+    {
+        Lock        lock(m_lock);
+        DWORD       bytes;
+        BOOL        result;
+        DWORD       insize = path.length() + 1 + value.length() + 1;
+
+        m_input.resize(insize);
+        memcpy(&m_input[0], path.c_str(), path.length() + 1);
+        memcpy(&m_input[0] + path.length() + 1, value.c_str(), value.length() + 1);
+
+        DebugPrint(("XenIfaceItf: Write \"%s\" = \"%s\"\n", (const char*)path.c_str(), (const char*)value.c_str()));
+        result = Ioctl(IOCTL_XENIFACE_STORE_WRITE,
+                    &m_input[0], insize, 
+                    NULL, 0, 
+                    &bytes);
+        if (!result)
+            return HRESULT_FROM_WIN32(GetLastError());
+        return S_OK;
+    }
+    HRESULT   TryRemove(const String& path)
+    {
+        DWORD       bytes;
+        BOOL        result;
+
+        DebugPrint(("XenIfaceItf: Remove \"%s\"\n", (const char*)path.c_str()));
+        result = Ioctl(IOCTL_XENIFACE_STORE_REMOVE,
+                    (void*)path.c_str(), path.length() + 1,
+                    NULL, 0, 
+                    &bytes);
+        if (!result)
+            return HRESULT_FROM_WIN32(GetLastError());
+        return S_OK;
+    }
+    HRESULT   TryDirectory(const String& path, StringVct* values)
+    {
+        Lock        lock(m_lock);
+        DWORD       bytes;
+        HRESULT     hr;
+
+        DebugPrint(("XenIfaceItf: Directory \"%s\"\n", (const char*)path.c_str()));
+        hr = Query(IOCTL_XENIFACE_STORE_DIRECTORY, path, &bytes);
+        if (FAILED(hr))
+            return hr;
+
+        ParseDirectory(&m_buffer[0], bytes, values);
+        return S_OK;
+    }
+    // changes each time a new handle is opened; watches registered on an
+    // earlier handle went with it
+    ULONG     Generation() const
+    {
+        return (ULONG)m_generation;
+    }
+    // logical reads (Read and Directory) and the ioctls they took
+    void      Stats(ULONG* queries, ULONG* ioctls)
+    {
+        Lock        lock(m_lock);
+
+        *queries = m_queries;
+        *ioctls  = m_queryIoctls;
+    }
+    // applies the queued operations in order, stopping at the first failure;
+    // other users of the connection wait until done. xenstore has no way for
+    // a guest to group writes here, so callers put the key dom0 acts on last
+    void      Flush(XenIfaceBatch& batch)
+    {
+        Lock        lock(m_lock);
+
+        DebugPrint(("XenIfaceItf: Flush %d operations\n", batch.Count()));
+        ThrowIfFailed(batch.Apply(*this));
+        batch.Clear();
+    }
+    PVOID     Watch(const String& path, HANDLE event)
+    {
+        XENIFACE_STORE_ADD_WATCH_IN     in;
+        XENIFACE_STORE_ADD_WATCH_OUT    out;
+        DWORD       bytes;
+        BOOL        result;
+
+        in.Path         = (PCHAR)path.c_str();
+        in.PathLength   = (ULONG)path.length() + 1;
+        in.Event        = event;
+        out.Context     = NULL;
+
+        DebugPrint(("XenIfaceItf: Watch \"%s\"\n", (const char*)path.c_str()));
+        result = Ioctl(IOCTL_XENIFACE_STORE_ADD_WATCH,
+                    &in, sizeof(in),
+                    &out, sizeof(out),
+                    &bytes);
+        if (!result)
+            ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+        return out.Context;
+    }
+    void      Unwatch(PVOID context)
+    {
+        XENIFACE_STORE_REMOVE_WATCH_IN  in;
+        DWORD       bytes;
+        BOOL        result;
+
+        in.Context      = context;
+
+        DebugPrint(("XenIfaceItf: Unwatch 0x%p\n", context));
+        result = Ioctl(IOCTL_XENIFACE_STORE_REMOVE_WATCH,
+                    &in, sizeof(in),
+                    NULL, 0,
+                    &bytes);
+        if (!result)
+            ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+    }
+
+private:
+    HANDLE              m_handle;
+    volatile LONG       m_generation;   // bumped by Open
+    CRITICAL_SECTION    m_lock;
+    std::vector<char>   m_buffer;       // reused by Read and Directory, under m_lock
+    std::vector<char>   m_input;        // reused by Write, under m_lock
+    ULONG               m_queries;
+    ULONG               m_queryIoctls;
+
+    // large enough for typical keys, grown on demand up to the store's value limit
+    enum { QueryBufferSize = 1024 };
+
+    class Lock
+    {
+    public:
+        Lock(CRITICAL_SECTION& cs) : m_cs(&cs)  { EnterCriticalSection(m_cs); }
+        ~Lock()                                 { LeaveCriticalSection(m_cs); }
+    private:
+        LPCRITICAL_SECTION m_cs;
+    };
+
+    static SRWLOCK* SharedLock()
+    {
+        static SRWLOCK  lock = SRWLOCK_INIT;
+        return &lock;
+    }
+    static XenIfaceItf*& SharedItf()
+    {
+        static XenIfaceItf* itf = NULL;
+        return itf;
+    }
+    static ULONG& SharedRefs()
+    {
+        static ULONG    refs = 0;
+        return refs;
+    }
+    // device path of the last interface opened, saves the SetupDi enumeration
+    static String& DevicePath()
+    {
+        static String   path;
+        return path;
+    }
+
+    void Open()
     {
         HDEVINFO                            Info;
         SP_DEVICE_INTERFACE_DATA            ItfData;
@@ -74,6 +311,22 @@ public:
         ULONG                               Length;
         BOOL                                Result;
 
+        AcquireSRWLockShared(SharedLock());
+        String cached = DevicePath();
+        ReleaseSRWLockShared(SharedLock());
+
+        if (!cached.empty()) {
+            DebugPrint(("XenIfaceItf: Opening \"%s\"\n", cached.c_str()));
+            m_handle = CreateFile(cached.c_str(),
+                                GENERIC_READ | GENERIC_WRITE,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_EXISTING, 0, NULL);
+            if (m_handle != INVALID_HANDLE_VALUE) {
+                InterlockedIncrement(&m_generation);
+                return;
+            }
+        }
+
         Info = SetupDiGetClassDevs(&GUID_INTERFACE_XENIFACE, NULL, NULL,
                                    DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
         if (Info == INVALID_HANDLE_VALUE) {
@@ -106,6 +359,11 @@ public:
                                     GENERIC_READ | GENERIC_WRITE,
                                     FILE_SHARE_READ | FILE_SHARE_WRITE,
                                     NULL, OPEN_EXISTING, 0, NULL);
+                if (m_handle != INVALID_HANDLE_VALUE) {
+                    AcquireSRWLockExclusive(SharedLock());
+                    DevicePath() = ItfDetailData->DevicePath;
+                    ReleaseSRWLockExclusive(SharedLock());
+                }
             }
             delete [] ItfDetailData;
             if (m_handle != INVALID_HANDLE_VALUE)
@@ -115,156 +373,148 @@ public:
             ItfData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
         }
         SetupDiDestroyDeviceInfoList(Info);
+        if (m_handle != INVALID_HANDLE_VALUE)
+            InterlockedIncrement(&m_generation);
     }
-    ~XenIfaceItf() 
+    void Close()
     {
         if (m_handle != INVALID_HANDLE_VALUE)
             CloseHandle(m_handle);
+        m_handle = INVALID_HANDLE_VALUE;
     }
-
-    String    Read(const String& path)
+    bool IsDisconnected(DWORD err)
     {
-        DWORD       bytes(0);
-        BOOL        result;
-        char*       out;
-
-        if (m_handle == INVALID_HANDLE_VALUE)
-            ThrowIfFailed(E_HANDLE);
-
-        DebugPrint(("XenIfaceItf: Read \"%s\"\n", (const char*)path.c_str()));
-        result = DeviceIoControl(m_handle, IOCTL_XENIFACE_STORE_READ,
-                    (void*)path.c_str(), path.length() + 1,
-                    NULL, 0, 
-                    &bytes, NULL);
-        ThrowIfUnexpectedError(result, GetLastError());
-        if (bytes == 0)
-            ThrowIfFailed(E_UNEXPECTED);
-        DebugPrint(("XenIfaceItf: Read \"%s\" => %d bytes\n", (const char*)path.c_str(), bytes));
-
-        out = new char[bytes];
-        if (!out) 
-            ThrowIfFailed(E_OUTOFMEMORY);
-
-        result = DeviceIoControl(m_handle, IOCTL_XENIFACE_STORE_READ,
-                    (void*)path.c_str(), path.length() + 1,
-                    out, bytes,
-                    &bytes, NULL);
-        if (!result) {
-            delete [] out;
-            ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
-        } 
-        String value = out;
-        delete [] out;
-        DebugPrint(("XenIfaceItf: Read \"%s\" => \"%s\"\n", (const char*)path.c_str(), (const char*)value.c_str()));
-        return value;
+        return (err == ERROR_INVALID_HANDLE ||
+                err == ERROR_DEVICE_REMOVED ||
+                err == ERROR_DEV_NOT_EXIST ||
+                err == ERROR_DEVICE_NOT_CONNECTED);
     }
-    void      Write(const String& path, const String& value) 
+    // DeviceIoControl on the connection, reopening the device once if it has gone away,
+    // fails with ERROR_INVALID_HANDLE (E_HANDLE) when there is no device
+    BOOL Ioctl(DWORD code, PVOID in, DWORD insize, PVOID out, DWORD outsize, DWORD* bytes)
     {
-        DWORD       bytes;
+        Lock        lock(m_lock);
         BOOL        result;
-        DWORD       insize = path.length() + 1 + value.length() + 1;
-        char*       in;
+        DWORD       err;
 
         if (m_handle == INVALID_HANDLE_VALUE)
-            ThrowIfFailed(E_HANDLE);
-
-        in = new char[insize];
-        if (!in)
-            ThrowIfFailed(E_OUTOFMEMORY);
-
-        memcpy(in, path.c_str(), path.length() + 1);
-        memcpy(in + path.length() + 1, value.c_str(), value.length() + 1);
+            Open();
+        if (m_handle == INVALID_HANDLE_VALUE) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
 
-        DebugPrint(("XenIfaceItf: Write \"%s\" = \"%s\"\n", (const char*)path.c_str(), (const char*)value.c_str()));
-        result = DeviceIoControl(m_handle, IOCTL_XENIFACE_STORE_WRITE,
-                    (void*)in, insize, 
-                    NULL, 0, 
-                    &bytes, NULL);
+        result = DeviceIoControl(m_handle, code, in, insize, out, outsize, bytes, NULL);
+        err = GetLastError();
+        if (!result && IsDisconnected(err)) {
+            DebugPrint(("XenIfaceItf: Reconnecting (%d)\n", err));
+            Close();
+            AcquireSRWLockExclusive(SharedLock());
+            DevicePath().clear();
+            ReleaseSRWLockExclusive(SharedLock());
+            Open();
+            if (m_handle == INVALID_HANDLE_VALUE) {
+                SetLastError(ERROR_INVALID_HANDLE);
+                return FALSE;
+            }
 
-        delete [] in;
-        if (!result)
-            ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+            result = DeviceIoControl(m_handle, code, in, insize, out, outsize, bytes, NULL);
+            err = GetLastError();
+        }
+        SetLastError(err);
+        return result;
     }
-    void      Remove(const String& path) 
+
+    // issues a Read or Directory ioctl into m_buffer, caller holds m_lock
+    HRESULT Query(DWORD code, const String& path, DWORD* bytes)
     {
-        DWORD       bytes;
+        DWORD       needed(0);
         BOOL        result;
+        DWORD       err;
+        ULONG       ioctls(1);
 
-        if (m_handle == INVALID_HANDLE_VALUE)
-            ThrowIfFailed(E_HANDLE);
+        if (m_buffer.empty())
+            m_buffer.resize(QueryBufferSize);
 
-        DebugPrint(("XenIfaceItf: Remove \"%s\"\n", (const char*)path.c_str()));
-        result = DeviceIoControl(m_handle, IOCTL_XENIFACE_STORE_REMOVE,
+        *bytes = 0;
+        result = Ioctl(code,
                     (void*)path.c_str(), path.length() + 1,
-                    NULL, 0, 
-                    &bytes, NULL);
-        if (!result)
-            ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+                    &m_buffer[0], m_buffer.size(),
+                    bytes);
+        if (!result) {
+            err = GetLastError();
+            if (!IsBufferTooSmall(err))
+                return HRESULT_FROM_WIN32(err);
+
+            // value does not fit, ask for its size and retry
+            ++ioctls;
+            result = Ioctl(code,
+                        (void*)path.c_str(), path.length() + 1,
+                        NULL, 0,
+                        &needed);
+            if (!result && IsUnexpectedError(GetLastError()))
+                return HRESULT_FROM_WIN32(GetLastError());
+            if (needed <= m_buffer.size())
+                return HRESULT_FROM_WIN32(err);
+            DebugPrint(("XenIfaceItf: \"%s\" => %d bytes\n", (const char*)path.c_str(), needed));
+
+            m_buffer.resize(needed);
+            ++ioctls;
+            result = Ioctl(code,
+                        (void*)path.c_str(), path.length() + 1,
+                        &m_buffer[0], m_buffer.size(),
+                        bytes);
+            if (!result)
+                return HRESULT_FROM_WIN32(GetLastError());
+        }
+        if (*bytes == 0)
+            return E_UNEXPECTED;
+
+        ++m_queries;
+        m_queryIoctls += ioctls;
+        DebugPrint(("XenIfaceItf: \"%s\" => %d bytes in %d ioctls (%d ioctls/%d queries)\n",
+                    (const char*)path.c_str(), *bytes, ioctls, m_queryIoctls, m_queries));
+        return S_OK;
     }
-    StringVct Directory(const String& path) 
+    static void ParseDirectory(const char* buffer, DWORD bytes, StringVct* values)
     {
-        DWORD       bytes(0);
-        BOOL        result;
-        char*       out;
-
-        if (m_handle == INVALID_HANDLE_VALUE)
-            ThrowIfFailed(E_HANDLE);
+        const char* end = buffer + bytes;
 
-        DebugPrint(("XenIfaceItf: Directory \"%s\"\n", (const char*)path.c_str()));
-        result = DeviceIoControl(m_handle, IOCTL_XENIFACE_STORE_DIRECTORY,
-                    (void*)path.c_str(), path.length() + 1,
-                    NULL, 0, 
-                    &bytes, NULL);
-        ThrowIfUnexpectedError(result, GetLastError());
-        if (bytes == 0)
-            ThrowIfFailed(E_UNEXPECTED);
-        DebugPrint(("XenIfaceItf: Directory \"%s\" => %d bytes\n", (const char*)path.c_str(), bytes));
-
-        out = new char[bytes];
-        if (!out) 
-            ThrowIfFailed(E_OUTOFMEMORY);
-
-        result = DeviceIoControl(m_handle, IOCTL_XENIFACE_STORE_DIRECTORY,
-                    (void*)path.c_str(), path.length() + 1,
-                    out, bytes,
-                    &bytes, NULL);
-        if (!result) {
-            delete [] out;
-            ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
-        } 
-        StringVct values;
-        for (const char* ptr = out; *ptr; ) {
-            size_t len = strlen(ptr) + 1;
-            String str = String(ptr);
+        values->clear();
+        for (const char* ptr = buffer; ptr < end && *ptr; ) {
+            size_t len = strnlen(ptr, end - ptr);
+            String str = String(ptr, len);
             DebugPrint(("XenIfaceItf:  => \"%s\"\n", (const char*)str.c_str()));
-            values.push_back(str);
-            ptr += len;
+            values->push_back(str);
+            ptr += len + 1;
         }
-        delete [] out;
-        return values;    
     }
-
-private:
-    HANDLE m_handle;
-
-    void ThrowIfUnexpectedError(BOOL result, DWORD err)
+    bool IsBufferTooSmall(DWORD err)
+    {
+        // xeniface fails a short, non-empty output buffer as an invalid parameter
+        return (err == ERROR_NOT_ENOUGH_MEMORY ||
+                err == ERROR_OUTOFMEMORY ||
+                err == ERROR_BUFFER_OVERFLOW ||
+                err == ERROR_INSUFFICIENT_BUFFER ||
+                err == ERROR_MORE_DATA ||
+                err == ERROR_INVALID_PARAMETER ||
+                err == ERROR_INVALID_USER_BUFFER);
+    }
+    bool IsUnexpectedError(DWORD err)
     {
-        if (result)
-            return;
-
         // acceptable failure is STATUS_BUFFER_OVERFLOW, 1 of these should cover it
         if (err == ERROR_NOT_ENOUGH_MEMORY)
-            return;
+            return false;
         if (err == ERROR_OUTOFMEMORY)
-            return;
+            return false;
         if (err == ERROR_BUFFER_OVERFLOW)
-            return;
+            return false;
         if (err == ERROR_INSUFFICIENT_BUFFER)
-            return;
+            return false;
         if (err == ERROR_MORE_DATA)
-            return;
+            return false;
 
-        ThrowIfFailed(HRESULT_FROM_WIN32(err));
+        return true;
     }
     void ThrowIfFailed(HRESULT hr)
     {
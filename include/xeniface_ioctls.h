@@ -43,6 +43,24 @@ DEFINE_GUID(GUID_INTERFACE_XENIFACE, \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_XENIFACE_STORE_REMOVE \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_STORE_ADD_WATCH \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_XENIFACE_STORE_REMOVE_WATCH \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _XENIFACE_STORE_ADD_WATCH_IN {
+    PCHAR   Path;
+    ULONG   PathLength; // including NUL terminator
+    HANDLE  Event;      // signalled each time the watch fires
+} XENIFACE_STORE_ADD_WATCH_IN, *PXENIFACE_STORE_ADD_WATCH_IN;
+
+typedef struct _XENIFACE_STORE_ADD_WATCH_OUT {
+    PVOID   Context;
+} XENIFACE_STORE_ADD_WATCH_OUT, *PXENIFACE_STORE_ADD_WATCH_OUT;
+
+typedef struct _XENIFACE_STORE_REMOVE_WATCH_IN {
+    PVOID   Context;
+} XENIFACE_STORE_REMOVE_WATCH_IN, *PXENIFACE_STORE_REMOVE_WATCH_IN;
 
 #endif // _XENIFACE_IOCTLS_H_
 
@@ -33,66 +33,70 @@
 #include <stdio.h>
 #include "bytes.h"
 
-static __inline char NumToAscii(unsigned char num)
-{
-    if (num < 26)
-        return 'A' + num;
-    if (num < 52)
-        return 'a' + num - 26;
-    if (num < 62)
-        return '0' + num - 52;
-    if (num == 62)
-        return '+';
-    if (num == 63)
-        return '/';
-    return '=';
-}
-static __inline unsigned char AsciiToBase64(char ch)
-{
-    if (ch >= 'A' && ch <= 'Z')
-        return ch - 'A';
-    if (ch >= 'a' && ch <= 'z')
-        return ch - 'a' + 26;
-    if (ch >= '0' && ch <= '9')
-        return ch - '0' + 52;
-    if (ch == '+')
-        return 62;
-    if (ch == '/')
-        return 63;
-    return 64;
-}
+static const char Base64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// sextet value of each character, 0x40 for '=' and 0x80 outside the alphabet
+static const unsigned char Base64Values[256] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x40, 0x80, 0x80,
+    0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+#define BASE64_PAD      0x40
+#define BASE64_INVALID  0x80
 
 // constructors
 Bytes::Bytes() : 
-        m_bytes(NULL), m_length(0), m_capacity(0)
+        m_bytes(m_inline), m_length(0), m_capacity(InlineCapacity)
 {
 }
 Bytes::Bytes(const Bytes& bytes) : 
-        m_bytes(NULL), m_length(bytes.m_length), m_capacity(0)
+        m_bytes(m_inline), m_length(0), m_capacity(InlineCapacity)
+{
+    Reserve(bytes.m_length);
+    memcpy(m_bytes, bytes.m_bytes, bytes.m_length);
+    m_length = bytes.m_length;
+}
+Bytes::Bytes(Bytes&& bytes) : 
+        m_bytes(m_inline), m_length(0), m_capacity(InlineCapacity)
 {
-    Resize(bytes.m_capacity);
-    memcpy(m_bytes, bytes.m_bytes, m_length);
+    Take(bytes);
 }
 Bytes::Bytes(size_t capacity) : 
-        m_bytes(NULL), m_length(0), m_capacity(0)
+        m_bytes(m_inline), m_length(0), m_capacity(InlineCapacity)
 {
-    Resize(capacity);
+    Reserve(capacity);
 }
 Bytes::Bytes(const unsigned char* bytes, size_t length) : 
-        m_bytes(NULL), m_length(length), m_capacity(0)
+        m_bytes(m_inline), m_length(0), m_capacity(InlineCapacity)
 {
-    Resize(length + 1);
+    Reserve(length + 1);
     memcpy(m_bytes, bytes, length);
+    m_length = length;
 }
 Bytes::Bytes(const string& base64) : 
-        m_bytes(NULL), m_length(0), m_capacity(0)
+        m_bytes(m_inline), m_length(0), m_capacity(InlineCapacity)
 {
     FromBase64(base64);
 }
 Bytes::Bytes(const char* chars, size_t length, char terminator) :
-        m_bytes(NULL), m_length(0), m_capacity(0)
+        m_bytes(m_inline), m_length(0), m_capacity(InlineCapacity)
 {
-    Resize(length + 2);
+    Reserve(length + 2);
     memcpy(m_bytes, chars, length);
     m_bytes[length] = terminator;
     m_length = length + 1;
@@ -110,19 +114,32 @@ Bytes& Bytes::operator=(const Bytes& bytes)
     if (this == &bytes)
         return *this;
 
-    Clear();
-    Resize(bytes.m_capacity);
+    m_length = 0;
+    Reserve(bytes.m_length);
     memcpy(m_bytes, bytes.m_bytes, bytes.m_length);
     m_length = bytes.m_length;
     return *this;
 }
+Bytes& Bytes::operator=(Bytes&& bytes)
+{
+    if (this == &bytes)
+        return *this;
+
+    Clear();
+    Take(bytes);
+    return *this;
+}
 Bytes& Bytes::operator=(const string& base64)
 {
     return FromBase64(base64);
 }
-const Bytes Bytes::operator+(const Bytes& bytes) const 
+Bytes Bytes::operator+(const Bytes& bytes) const 
 {
-    return Bytes(*this) += bytes;
+    Bytes retval;
+    retval.Reserve(m_length + bytes.m_length + 1);
+    retval.Append(m_bytes, m_length);
+    retval.Append(bytes.m_bytes, bytes.m_length);
+    return retval;
 }
 Bytes& Bytes::operator+=(unsigned char byte)
 {
@@ -178,44 +195,109 @@ Bytes::operator const unsigned char*() const
 // conversions
 Bytes& Bytes::FromBase64(const string& base64)
 {
+    return FromBase64(base64, false);
+}
+Bytes& Bytes::FromBase64(const string& base64, bool strict)
+{
+    const unsigned char*    in = (const unsigned char*)base64.data();
+    size_t                  len = base64.length();
+    size_t                  i = 0;
+
     Clear();
-    if (base64.length() % 4)
+    if (len % 4)
         throw "InvalidInputLength";
-    Resize( (base64.length() / 4) * 3 );
-    for (size_t i = 0; i < base64.length(); i += 4) {
-        unsigned char val[4] =
+    Reserve( (len / 4) * 3 );
+
+    // only the last quad may be padded, the others go 8 characters at a
+    // time until one is not in the alphabet
+    size_t body = len ? len - 4 : 0;
+    for (; i + 8 <= body; i += 8) {
+        unsigned char v[8];
+        unsigned char flags = 0;
+        for (size_t j = 0; j < 8; ++j) {
+            v[j] = Base64Values[in[i + j]];
+            flags |= v[j];
+        }
+        if (flags & (BASE64_PAD | BASE64_INVALID))
+            break;
+
+        ULONGLONG bits = ((ULONGLONG)v[0] << 42) | ((ULONGLONG)v[1] << 36) |
+                         ((ULONGLONG)v[2] << 30) | ((ULONGLONG)v[3] << 24) |
+                         ((ULONGLONG)v[4] << 18) | ((ULONGLONG)v[5] << 12) |
+                         ((ULONGLONG)v[6] << 6)  |  (ULONGLONG)v[7];
+        unsigned char* out = m_bytes + m_length;
+        out[0] = (unsigned char)(bits >> 40);
+        out[1] = (unsigned char)(bits >> 32);
+        out[2] = (unsigned char)(bits >> 24);
+        out[3] = (unsigned char)(bits >> 16);
+        out[4] = (unsigned char)(bits >> 8);
+        out[5] = (unsigned char)bits;
+        m_length += 6;
+    }
+
+    // lenient decoding stops at the first quad that is padded or not in the
+    // alphabet, strict decoding throws unless that is the canonical last quad
+    for (; i < len; i += 4) {
+        unsigned char v[4] =
         {
-            AsciiToBase64(base64[i]),
-            AsciiToBase64(base64[i + 1]),
-            AsciiToBase64(base64[i + 2]),
-            AsciiToBase64(base64[i + 3])
+            Base64Values[in[i]],
+            Base64Values[in[i + 1]],
+            Base64Values[in[i + 2]],
+            Base64Values[in[i + 3]]
         };
-        m_bytes[m_length++] = (val[0] << 2) | (val[1] >> 4);
-        if (val[2] == 64) break;
-        m_bytes[m_length++] = (val[1] << 4) | (val[2] >> 2);
-        if (val[3] == 64) break;
-        m_bytes[m_length++] = (val[2] << 6) | val[3];
+        if (strict) {
+            bool last = (i + 4 == len);
+            if ((v[0] | v[1] | v[2] | v[3]) & BASE64_INVALID)
+                throw "InvalidCharacter";
+            if ((v[0] | v[1]) & BASE64_PAD)
+                throw "InvalidPadding";
+            if ((v[2] & BASE64_PAD) && !(v[3] & BASE64_PAD))
+                throw "InvalidPadding";
+            if ((v[3] & BASE64_PAD) && !last)
+                throw "InvalidPadding";
+            if ((v[2] & BASE64_PAD) && (v[1] & 0x0f))
+                throw "NonCanonicalPadding";
+            if ((v[3] & BASE64_PAD) && !(v[2] & BASE64_PAD) && (v[2] & 0x03))
+                throw "NonCanonicalPadding";
+        }
+        if ((v[0] | v[1]) & (BASE64_PAD | BASE64_INVALID))
+            break;
+        m_bytes[m_length++] = (v[0] << 2) | (v[1] >> 4);
+        if (v[2] & (BASE64_PAD | BASE64_INVALID))
+            break;
+        m_bytes[m_length++] = (v[1] << 4) | (v[2] >> 2);
+        if (v[3] & (BASE64_PAD | BASE64_INVALID))
+            break;
+        m_bytes[m_length++] = (v[2] << 6) | v[3];
     }
     return *this;
 }
 string Bytes::ToBase64() const
 {
-    string retval;
-    for (size_t i = 0; i < m_length; i+= 3) {
-        unsigned char in[3] = { 0, 0, 0 };
-        int len = 0;
-        for (size_t j = 0; j < 3; ++j) {
-            if (i + j < m_length) {
-                in[j] = m_bytes[i + j];
-                ++len;
-            }
-        }
-        char out[5] = { '=', '=', '=', '=', 0 };
-        out[0] = NumToAscii( in[0] >> 2 );
-        out[1] = NumToAscii( ((in[0] & 0x03) << 4) | ((in[1] & 0xf0) >> 4) );
-        out[2] = len > 1 ? NumToAscii( ((in[1] & 0x0f) << 2) | ((in[2] & 0xc0) >> 6) ) : '=';
-        out[3] = len > 2 ? NumToAscii( (in[2] & 0x3f) ) : '=';
-        retval += out;
+    string retval(((m_length + 2) / 3) * 4, '=');
+    if (m_length == 0)
+        return retval;
+
+    char*   out = &retval[0];
+    size_t  i = 0;
+    for (; i + 3 <= m_length; i += 3) {
+        unsigned long bits = ((unsigned long)m_bytes[i] << 16) |
+                             ((unsigned long)m_bytes[i + 1] << 8) |
+                              (unsigned long)m_bytes[i + 2];
+        out[0] = Base64Chars[(bits >> 18) & 0x3f];
+        out[1] = Base64Chars[(bits >> 12) & 0x3f];
+        out[2] = Base64Chars[(bits >> 6) & 0x3f];
+        out[3] = Base64Chars[bits & 0x3f];
+        out += 4;
+    }
+    if (i < m_length) {
+        unsigned long bits = (unsigned long)m_bytes[i] << 16;
+        if (i + 1 < m_length)
+            bits |= (unsigned long)m_bytes[i + 1] << 8;
+        out[0] = Base64Chars[(bits >> 18) & 0x3f];
+        out[1] = Base64Chars[(bits >> 12) & 0x3f];
+        if (i + 1 < m_length)
+            out[2] = Base64Chars[(bits >> 6) & 0x3f];
     }
     return retval;
 }
@@ -270,35 +352,132 @@ size_t Bytes::Capacity() const
 
 void Bytes::Clear()
 {
-    if (m_bytes)
+    if (m_bytes != m_inline)
         delete [] m_bytes;
-    m_bytes = NULL;
+    m_bytes = m_inline;
     m_length = 0;
-    m_capacity = 0;
+    m_capacity = InlineCapacity;
 }
-void Bytes::Resize(size_t new_capacity)
+// grows to at least capacity, at least doubling so that appends are
+// amortised; the contents up to m_length are kept, the rest is undefined
+void Bytes::Reserve(size_t capacity)
 {
+    if (capacity <= m_capacity)
+        return;
+
+    size_t new_capacity = m_capacity * 2;
+    if (new_capacity < capacity)
+        new_capacity = capacity;
+
     unsigned char* new_bytes = new unsigned char[new_capacity];
     if (new_bytes == NULL)
         throw "OutOfMemory";
-    memset(new_bytes, 0, new_capacity);
-    size_t new_length = 0;
-    if (m_bytes) {
-        new_length = m_length;
-        if (new_length > new_capacity)
-            new_length = new_capacity;
-        memcpy(new_bytes, m_bytes, new_length);
+    memcpy(new_bytes, m_bytes, m_length);
+    if (m_bytes != m_inline)
         delete [] m_bytes;
-    }
     m_bytes = new_bytes;
-    m_length = new_length;
     m_capacity = new_capacity;
 }
 void Bytes::Append(const unsigned char* bytes, size_t length)
 {
     if (m_length + length >= m_capacity)
-        Resize(m_capacity + length + 1);
-    for (size_t i = 0; i < length; ++i)
-        m_bytes[m_length + i] = bytes[i];
+        Reserve(m_length + length + 1);
+    memcpy(m_bytes + m_length, bytes, length);
     m_length += length;
 }
+// steals a heap buffer, copies an inline one; bytes is left empty
+void Bytes::Take(Bytes& bytes)
+{
+    if (bytes.m_bytes != bytes.m_inline) {
+        m_bytes = bytes.m_bytes;
+        m_capacity = bytes.m_capacity;
+    } else {
+        memcpy(m_inline, bytes.m_inline, bytes.m_length);
+    }
+    m_length = bytes.m_length;
+
+    bytes.m_bytes = bytes.m_inline;
+    bytes.m_length = 0;
+    bytes.m_capacity = InlineCapacity;
+}
+
+BytesView::BytesView() : m_bytes(NULL), m_length(0)
+{
+}
+BytesView::BytesView(const unsigned char* bytes, size_t length) : m_bytes(bytes), m_length(length)
+{
+}
+BytesView::BytesView(const Bytes& bytes) : m_bytes(bytes), m_length(bytes.Length())
+{
+}
+
+// sub-array access
+bool BytesView::Sub(size_t index, size_t length, BytesView* view) const
+{
+    // written so that neither test can overflow
+    if (index > m_length || length > m_length - index)
+        return false;
+    view->m_bytes = m_bytes + index;
+    view->m_length = length;
+    return true;
+}
+const unsigned char* BytesView::Ptr() const
+{
+    return m_bytes;
+}
+
+// dimmensions
+size_t BytesView::Length() const
+{
+    return m_length;
+}
+
+Base64View::Base64View(const string& base64) :
+        m_chars((const unsigned char*)base64.data()), m_length(0)
+{
+    size_t  len = base64.length();
+
+    if (len % 4)
+        throw "InvalidInputLength";
+
+    // same stopping rule as the lenient Bytes::FromBase64
+    for (size_t i = 0; i < len; i += 4) {
+        if ((Base64Values[m_chars[i]] | Base64Values[m_chars[i + 1]]) & (BASE64_PAD | BASE64_INVALID))
+            break;
+        ++m_length;
+        if (Base64Values[m_chars[i + 2]] & (BASE64_PAD | BASE64_INVALID))
+            break;
+        ++m_length;
+        if (Base64Values[m_chars[i + 3]] & (BASE64_PAD | BASE64_INVALID))
+            break;
+        ++m_length;
+    }
+}
+
+bool Base64View::Decode(size_t index, size_t length, unsigned char* buffer) const
+{
+    if (index > m_length || length > m_length - index)
+        return false;
+
+    // every byte asked for lies within valid quads, so padding and the
+    // sextets past the end only reach bytes that are skipped
+    const unsigned char*    in = m_chars + (index / 3) * 4;
+    size_t                  skip = index % 3;
+    while (length) {
+        unsigned long bits = ((unsigned long)(Base64Values[in[0]] & 0x3f) << 18) |
+                             ((unsigned long)(Base64Values[in[1]] & 0x3f) << 12) |
+                             ((unsigned long)(Base64Values[in[2]] & 0x3f) << 6) |
+                              (unsigned long)(Base64Values[in[3]] & 0x3f);
+        for (; skip < 3 && length; ++skip, --length)
+            *buffer++ = (unsigned char)(bits >> (16 - 8 * skip));
+        skip = 0;
+        in += 4;
+    }
+    return true;
+}
+
+// dimmensions
+size_t Base64View::Length() const
+{
+    return m_length;
+}
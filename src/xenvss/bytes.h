@@ -38,9 +38,14 @@ using namespace std;
 class Bytes
 {
 public:
+    // payloads up to this size, such as SCSI VPD pages, are held without
+    // a heap allocation
+    enum { InlineCapacity = 256 };
+
     // constructors
     Bytes();
     Bytes(const Bytes& bytes);
+    Bytes(Bytes&& bytes);
     Bytes(size_t capacity);
     Bytes(const unsigned char* bytes, size_t length);
     Bytes(const string& base64);
@@ -51,8 +56,9 @@ public:
 
     // operators
     Bytes& operator=(const Bytes& bytes);
+    Bytes& operator=(Bytes&& bytes);
     Bytes& operator=(const string& base64);
-    const Bytes operator+(const Bytes& bytes) const;
+    Bytes operator+(const Bytes& bytes) const;
     Bytes& operator+=(unsigned char byte);
     Bytes& operator+=(const Bytes& bytes);
     bool operator==(const Bytes& bytes) const;
@@ -66,6 +72,7 @@ public:
 
     // conversions
     Bytes& FromBase64(const string& base64);
+    Bytes& FromBase64(const string& base64, bool strict); // strict throws on anything but canonical base64
     string ToBase64() const;
     string ToString() const;
 
@@ -83,12 +90,58 @@ public:
 
 private:
     void Clear();
-    void Resize(size_t new_capacity);
+    void Reserve(size_t capacity);
     void Append(const unsigned char* bytes, size_t length);
+    void Take(Bytes& bytes);
 private:
-    unsigned char*  m_bytes;
+    unsigned char*  m_bytes;        // m_inline or a heap buffer
     size_t          m_capacity;
     size_t          m_length;
+    unsigned char   m_inline[InlineCapacity];
+};
+
+// a window onto bytes owned elsewhere, such as a decoded inquiry page; the
+// checked accessors report an out of range request rather than throwing
+class BytesView
+{
+public:
+    // constructors
+    BytesView();
+    BytesView(const unsigned char* bytes, size_t length);
+    BytesView(const Bytes& bytes);
+
+    // sub-array access, false unless [index, index + length) is in the view
+    bool Sub(size_t index, size_t length, BytesView* view) const;
+
+    // unchecked access to the whole view
+    const unsigned char* Ptr() const;
+
+    // dimmensions
+    size_t Length() const;
+
+private:
+    const unsigned char*    m_bytes;
+    size_t                  m_length;
+};
+
+// random access to the bytes a base64 string encodes, so a range can be
+// decoded straight into its final buffer; Length() is what a lenient
+// Bytes::FromBase64 would decode, the string must outlive the view
+class Base64View
+{
+public:
+    // constructor
+    Base64View(const string& base64);
+
+    // decodes [index, index + length) into buffer, false if not all valid
+    bool Decode(size_t index, size_t length, unsigned char* buffer) const;
+
+    // dimmensions
+    size_t Length() const;
+
+private:
+    const unsigned char*    m_chars;
+    size_t                  m_length;       // decoded
 };
 
 #endif // _XENVSS_BYTES_H_
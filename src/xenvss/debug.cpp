@@ -67,6 +67,11 @@ const char* __HR(HRESULT hr)
     case E_UNEXPECTED:      return "E_UNEXPECTED";
     case E_HANDLE:          return "E_HANDLE";
 
+    case HRESULT_FROM_WIN32(ERROR_TIMEOUT):
+        return "ERROR_TIMEOUT";
+    case HRESULT_FROM_WIN32(ERROR_CANCELLED):
+        return "ERROR_CANCELLED";
+
     case CLASS_E_CLASSNOTAVAILABLE: 
         return "CLASS_E_CLASSNOTAVAILABLE";
     case CLASS_E_NOAGGREGATION:
@@ -0,0 +1,107 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENVSS_DOM0_H_
+#define _XENVSS_DOM0_H_
+
+#include <windows.h>
+#include "debug.h"
+
+//=============================================================================
+// dom0 serves one request at a time through m_Vm, so its requests are
+// serialised; the owner is a set id, which may hold it across callbacks.
+// nested acquires by the owner do not wait
+class Dom0Token
+{
+public:
+    Dom0Token() : m_owner(GUID_NULL), m_depth(0)
+    {
+        InitializeCriticalSection(&m_lock);
+        m_free = CreateEvent(NULL, TRUE, TRUE, NULL);
+    }
+    ~Dom0Token()
+    {
+        CloseHandle(m_free);
+        DeleteCriticalSection(&m_lock);
+    }
+
+    bool TryAcquire(const GUID& owner)
+    {
+        bool    acquired(false);
+
+        EnterCriticalSection(&m_lock);
+        if (m_depth == 0 || IsEqualGUID(m_owner, owner)) {
+            if (m_depth == 0) {
+                m_owner = owner;
+                ResetEvent(m_free);
+            }
+            ++m_depth;
+            acquired = true;
+        }
+        LeaveCriticalSection(&m_lock);
+        return acquired;
+    }
+    void Acquire(const GUID& owner)
+    {
+        while (!TryAcquire(owner))
+            WaitForSingleObject(m_free, INFINITE);
+    }
+    // as Acquire, false if cancel is signalled first
+    bool Acquire(const GUID& owner, HANDLE cancel)
+    {
+        HANDLE  handles[2] = { cancel, m_free };
+
+        while (!TryAcquire(owner)) {
+            if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0)
+                return false;
+        }
+        return true;
+    }
+    void Release(const GUID& owner)
+    {
+        EnterCriticalSection(&m_lock);
+        if (m_depth == 0 || !IsEqualGUID(m_owner, owner)) {
+            Trace("{%s} does not hold dom0\n", __Guid(owner).c_str());
+        } else if (--m_depth == 0) {
+            m_owner = GUID_NULL;
+            SetEvent(m_free);
+        }
+        LeaveCriticalSection(&m_lock);
+    }
+
+private:
+    CRITICAL_SECTION    m_lock;
+    HANDLE              m_free;     // signalled when there is no owner
+    GUID                m_owner;
+    ULONG               m_depth;
+};
+
+#endif // _XENVSS_DOM0_H_
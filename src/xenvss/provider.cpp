@@ -32,12 +32,17 @@
 #include "provider.h"
 #include "debug.h"
 #include "bytes.h"
+#include "stats.h"
 
 #include <winioctl.h>
 #include <xeniface_interface.h>
+#include "setwait.h"
+#include "resolvers.h"
+#include "dom0.h"
 
 #include <algorithm> 
 #include <functional>
+#include <utility>
 #include <cctype>
 #include <locale>
 
@@ -75,62 +80,48 @@ static inline bool __StringToBool(std::string& str) {
     } catch (...) {             \
     }
 
-#pragma pack(push, 1)
-typedef struct _VPD_IDENTIFICATION_DESCRIPTOR {
-    UCHAR   CodeSet     : 4;
-    UCHAR   Reserved    : 4;
-    UCHAR   Type        : 4;
-    UCHAR   Association : 2;
-    UCHAR   Reserved2   : 2;
-    UCHAR   Reserved3;
-    UCHAR   Length;
-    UCHAR   Identifier[1];
-} VPD_IDENTIFICATION_DESCRIPTOR, *PVPD_IDENTIFICATION_DESCRIPTOR;
-#pragma pack(pop)
-
-typedef struct _SETWAIT_OP {
-    const char*     set;
-    const char*     pass;
-    const char*     fail;
-} SETWAIT_OP, *PSETWAIT_OP;
-
-static const SETWAIT_OP CreateSnapshot      = { "create-snapshots", "snapshots-created", "snapshots-failed" };
-static const SETWAIT_OP CreateSnapshotInfo  = { "create-snapshotinfo", "snapshotinfo-created", "snapshotinfo-failed"};
-static const SETWAIT_OP ImportSnapshot      = { "import-snapshots", "snapshots-imported", "snapshot-import-failed" };
-static const SETWAIT_OP DeportSnapshot      = { "deport-snapshots", "snapshots-deported", "deport-snapshots-failed" };
-static const SETWAIT_OP DestroySnapshot     = { "destroy-snapshots", "snapshots-destroyed", "snapshots-destroy-failed" };
-
-static __inline void 
-__SetWait(
-    XenIfaceItf&        itf,
-    const string&       path,
-    const SETWAIT_OP&   op
-    )
-{
-    itf.Write(path + "/status", op.set);
+// VSS holds writes for at most 10 seconds across CommitSnapshots
+static SETWAIT_OP CreateSnapshot      = { "create-snapshots", "snapshots-created", "snapshots-failed", 8000 };
+static SETWAIT_OP CreateSnapshotInfo  = { "create-snapshotinfo", "snapshotinfo-created", "snapshotinfo-failed", 60000 };
+static SETWAIT_OP ImportSnapshot      = { "import-snapshots", "snapshots-imported", "snapshot-import-failed", 300000 };
+static SETWAIT_OP DeportSnapshot      = { "deport-snapshots", "snapshots-deported", "deport-snapshots-failed", 300000 };
+static SETWAIT_OP DestroySnapshot     = { "destroy-snapshots", "snapshots-destroyed", "snapshots-destroy-failed", 300000 };
 
-    for (;;) {
-        string value = itf.Read(path + "/status");
+static PSETWAIT_OP SetWaitOps[] = {
+    &CreateSnapshot, &CreateSnapshotInfo, &ImportSnapshot, &DeportSnapshot, &DestroySnapshot
+};
 
-        if (value == op.pass) {
-            TRY(itf.Remove(path + "/status"));
-            return;
-        }
-        if (value == op.fail) {
-            TRY(itf.Remove(path + "/status"));
-            throw E_FAIL;
-        }
+// how long the allow-VSS policy is trusted when xeniface cannot watch it
+#define POLICY_TTL          5000
 
-        // check for invalid value
-        if (value != op.set) {
-            Trace("\"%s\" != \"%s\"|\"%s\" for \"%s\"\n", value.c_str(), op.pass, op.fail, op.set);
-            throw E_INVALIDARG; // eek - unknown value
+static void
+__LoadTimeouts(
+    )
+{
+    HKEY    hKey;
+    LONG    lResult;
+
+    lResult = RegOpenKeyExA(HKEY_LOCAL_MACHINE, "SOFTWARE\\Citrix\\XenTools\\XenVss", 0, KEY_READ, &hKey);
+    if (lResult != ERROR_SUCCESS)
+        return;
+
+    for (ULONG i = 0; i < sizeof(SetWaitOps)/sizeof(SetWaitOps[0]); ++i) {
+        DWORD   Type;
+        DWORD   Data = 0;
+        DWORD   DataSize = sizeof(DWORD);
+
+        lResult = RegGetValueA(hKey, NULL, SetWaitOps[i]->set, 0, &Type, &Data, &DataSize);
+        if (lResult == ERROR_SUCCESS) {
+            if (Type == REG_DWORD && DataSize == sizeof(DWORD) && Data != 0) {
+                Trace("%s timeout %d ms\n", SetWaitOps[i]->set, Data);
+                SetWaitOps[i]->timeout = Data;
+            }
         }
-
-        // wait a sec before continuing
-        Sleep(1000);
     }
+
+    RegCloseKey(hKey);
 }
+
 static __inline BOOLEAN
 HasFlag(
     LONG        Flags,
@@ -181,55 +172,22 @@ __IsTargetId(
             Id.m_Type == VDSStorageIdTypeVendorSpecific &&
             Id.m_cbIdentifier == 4);
 }
-static __inline bool
-GetVdi(
-    const VDS_LUN_INFORMATION&  Lun, 
-    GUID*                       Vdi
-    ) 
+// the LUN's device-id descriptor flattened into a string, to key LunVdis
+static __inline string
+__LunKey(
+    const VDS_LUN_INFORMATION&  Lun
+    )
 {
-    for (ULONG i = 0; i < Lun.m_deviceIdDescriptor.m_cIdentifiers; ++i) {
-        const VDS_STORAGE_IDENTIFIER* Id = &Lun.m_deviceIdDescriptor.m_rgIdentifiers[i];
-        if (__IsTargetId(*Id)) {
-            if (Vdi) {
-                XenIfaceItf Store;
-
-                string targetid = trim(string((const char*)Id->m_rgbIdentifier, 4));
-                try {
-                    char    path[MAX_PATH];
+    string  Key;
 
-                    _snprintf_s(path, sizeof(path), MAX_PATH-1,
-                                "data/scsi/target/%s/frontend",
-                                targetid.c_str());
-                    string frontend = Store.Read(path);
-
-                    _snprintf_s(path, sizeof(path), MAX_PATH-1,
-                                "%s/backend",
-                                frontend.c_str());
-                    string backend = Store.Read(path);
-
-                    _snprintf_s(path, sizeof(path), MAX_PATH-1,
-                                "%s/sm-data/vdi-uuid",
-                                backend.c_str());
-                    string vdiuuid = Store.Read(path);
-
-                    *Vdi = Guid(vdiuuid);
-                } catch (...) {
-                    Trace("Exception trying to find vdi-uuid for target %s\n", targetid.c_str());
-                }
-            }
-            return true;
-        }
-    }
     for (ULONG i = 0; i < Lun.m_deviceIdDescriptor.m_cIdentifiers; ++i) {
-        const VDS_STORAGE_IDENTIFIER* Id = &Lun.m_deviceIdDescriptor.m_rgIdentifiers[i];
-        if (__IsVdiUuid(*Id)) {
-            if (Vdi) {
-                *Vdi = Guid(string((const char*)Id->m_rgbIdentifier, 36));
-            }
-            return true;
-        }
+        const VDS_STORAGE_IDENTIFIER& Id = Lun.m_deviceIdDescriptor.m_rgIdentifiers[i];
+        ULONG Header[3] = { (ULONG)Id.m_CodeSet, (ULONG)Id.m_Type, Id.m_cbIdentifier };
+
+        Key.append((const char*)Header, sizeof(Header));
+        Key.append((const char*)Id.m_rgbIdentifier, Id.m_cbIdentifier);
     }
-    return false;
+    return Key;
 }
 static __inline void*
 Clone(
@@ -252,28 +210,95 @@ Clone(
 
     return Dst;
 }
-static __inline bool
-__CloneFromPage83(
-    VDS_STORAGE_IDENTIFIER&     DstId,
-    const Bytes&                Page83
+// dom0 owner for a request that is not part of a snapshot set
+static __inline VSS_ID
+__RequestId(
     )
 {
-    for (size_t i = 4; i < Page83.Length(); ) {
-        const PVPD_IDENTIFICATION_DESCRIPTOR Desc = 
-                    (const PVPD_IDENTIFICATION_DESCRIPTOR)Page83.Ptr(i);
+    VSS_ID  Id = GUID_NULL;
 
-        if (DstId.m_CodeSet == (VDS_STORAGE_IDENTIFIER_CODE_SET)Desc->CodeSet &&
-            DstId.m_Type == (VDS_STORAGE_IDENTIFIER_TYPE)Desc->Type && 
-            Desc->Association == 0) {
+    Id.Data1 = GetCurrentThreadId();
+    Id.Data2 = 0xffff;
+    Id.Data3 = 0xffff;
+    return Id;
+}
+// snapshots queued for teardown survive a reload of the provider as values
+// "<snapshot VDI>" = "<VDI it was taken of>" under this key
+#define TEARDOWN_KEY    "SOFTWARE\\Citrix\\XenTools\\XenVss\\Teardown"
+
+static void
+__SaveTeardown(
+    const GUID&     Snapshot,
+    const GUID&     Source
+    )
+{
+    HKEY    hKey;
+    LONG    lResult;
+    string  Data = Guid(Source);
+
+    lResult = RegCreateKeyExA(HKEY_LOCAL_MACHINE, TEARDOWN_KEY, 0, NULL, 0, KEY_SET_VALUE, NULL, &hKey, NULL);
+    if (lResult != ERROR_SUCCESS) {
+        Trace("RegCreateKeyExA failed (%d)\n", lResult);
+        return;
+    }
 
-            DstId.m_cbIdentifier    = Desc->Length;
-            DstId.m_rgbIdentifier   = (BYTE*)Clone(Desc->Identifier, Desc->Length);
-            return true;
-        }
+    lResult = RegSetValueExA(hKey, Guid(Snapshot).c_str(), 0, REG_SZ,
+                             (const BYTE*)Data.c_str(), (DWORD)Data.length() + 1);
+    if (lResult != ERROR_SUCCESS)
+        Trace("RegSetValueExA failed (%d)\n", lResult);
 
-        i += (Desc->Length + 4);
+    RegCloseKey(hKey);
+}
+static void
+__ForgetTeardown(
+    const GUID&     Snapshot
+    )
+{
+    HKEY    hKey;
+    LONG    lResult;
+
+    lResult = RegOpenKeyExA(HKEY_LOCAL_MACHINE, TEARDOWN_KEY, 0, KEY_SET_VALUE, &hKey);
+    if (lResult != ERROR_SUCCESS)
+        return;
+
+    (VOID)RegDeleteValueA(hKey, Guid(Snapshot).c_str());
+    RegCloseKey(hKey);
+}
+static void
+__LoadTeardown(
+    GUID_GUID_MAP&  Pending
+    )
+{
+    HKEY    hKey;
+    LONG    lResult;
+
+    lResult = RegOpenKeyExA(HKEY_LOCAL_MACHINE, TEARDOWN_KEY, 0, KEY_READ, &hKey);
+    if (lResult != ERROR_SUCCESS)
+        return;
+
+    for (DWORD Index = 0; ; ++Index) {
+        char    Name[64];
+        char    Data[64];
+        DWORD   NameSize = sizeof(Name);
+        DWORD   DataSize = sizeof(Data) - 1;
+        DWORD   Type;
+
+        lResult = RegEnumValueA(hKey, Index, Name, &NameSize, NULL, &Type, (LPBYTE)Data, &DataSize);
+        if (lResult == ERROR_MORE_DATA)
+            continue;
+        if (lResult != ERROR_SUCCESS)
+            break;
+        Data[DataSize] = 0;
+
+        if (Type != REG_SZ || NameSize != 36 || strlen(Data) != 36) {
+            Trace("Ignoring teardown entry \"%s\"\n", Name);
+            continue;
+        }
+        Trace("Teardown of {%s} is pending\n", Name);
+        Pending[Guid(string(Name))] = Guid(string(Data));
     }
-    return false;
+
+    RegCloseKey(hKey);
 }
 //=============================================================================
 class AutoLock 
@@ -292,19 +317,29 @@ private:
 };
 //=============================================================================
 XenVssProvider::XenVssProvider(
-    ) : m_State(VSS_SS_UNKNOWN), m_SetId(GUID_NULL), m_Context(0), m_InVm(false), m_UseSrcSerialNumber(false), m_IsVssSupported(true)
+    ) : m_InVm(false), m_UseSrcSerialNumber(false), m_IsVssSupported(true),
+        m_Store(XenIfaceItf::Acquire()),
+        m_PolicyRead(0), m_TeardownThread(NULL)
 {
     DebugInitializeLogging();
+    StatsInitialize();
+    __LoadTimeouts();
 
     Trace("====>\n");
     InitializeCriticalSection(&m_CritSec);
-
-    XenIfaceItf Store;
+    InitializeCriticalSection(&m_TargetLock);
+    InitializeCriticalSection(&m_PolicyLock);
+    InitializeCriticalSection(&m_TeardownLock);
+    m_Cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_TeardownQueued = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_TeardownIdle = CreateEvent(NULL, TRUE, TRUE, NULL);
+
+    XenIfaceItf& Store(*m_Store);
     try {
         m_Vm = Store.Read("vss");
-        TRY(Store.Remove(m_Vm + "/snapshot"));
-        TRY(Store.Remove(m_Vm + "/snapinfo"));
-        TRY(Store.Remove(m_Vm + "/snapuuid"));
+        (VOID)Store.TryRemove(m_Vm + "/snapshot");
+        (VOID)Store.TryRemove(m_Vm + "/snapinfo");
+        (VOID)Store.TryRemove(m_Vm + "/snapuuid");
         Store.Write(m_Vm + "/status", "provider-initialized");
         m_InVm = true;
     } catch (HRESULT hr) {
@@ -313,6 +348,20 @@ XenVssProvider::XenVssProvider(
         Trace("Exception UNKNOWN\n");
     }
 
+    m_TargetWatch = new StoreWatch(*m_Store, "data/scsi/target");
+    m_PolicyWatch = new StoreWatch(*m_Store, "vm-data/allowvssprovider");
+    m_Resolvers = new ResolverPool(m_Cancel, MaxResolveThreads);
+    m_Dom0 = new Dom0Token();
+
+    // finish the teardown a previous instance left queued
+    if (m_InVm) {
+        AutoLock    Lock(m_TeardownLock);
+        __LoadTeardown(m_TeardownVdis);
+        if (!m_TeardownVdis.empty())
+            ResetEvent(m_TeardownIdle);
+        StartTeardown();
+    }
+
     // set m_UseSrcSerialNumber to false if VBD uses StorageManager's Page80/Page83 data
     // set m_UseSrcSerialNumber to true if VBD uses hard-coded Page80/Page83 data
 
@@ -322,6 +371,27 @@ XenVssProvider::~XenVssProvider(
     )
 {
     Trace("====>\n");
+    SetEvent(m_Cancel);
+    if (m_TeardownThread) {
+        WaitForSingleObject(m_TeardownThread, INFINITE);
+        CloseHandle(m_TeardownThread);
+    }
+    delete m_Resolvers;
+    while (!m_Sets.empty()) {
+        PSNAPSHOT_SET Set = m_Sets.begin()->second;
+        SetEvent(Set->Cancel);
+        DeleteSet(Set);
+    }
+    delete m_Dom0;
+    delete m_PolicyWatch;
+    delete m_TargetWatch;
+    XenIfaceItf::Release(m_Store);
+    DeleteCriticalSection(&m_TeardownLock);
+    DeleteCriticalSection(&m_PolicyLock);
+    DeleteCriticalSection(&m_TargetLock);
+    CloseHandle(m_TeardownIdle);
+    CloseHandle(m_TeardownQueued);
+    CloseHandle(m_Cancel);
     DeleteCriticalSection(&m_CritSec);
     Trace("<====\n");
 }
@@ -348,7 +418,6 @@ XenVssProvider::AreLunsSupported(
     )
 {
     HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
 
     Trace("====> (%d, %08x, 0x%p, 0x%p, 0x%p)\n", Count, Context, Devices, Luns, IsSupported);
     for (LONG Index = 0; Index < Count; ++Index) {
@@ -364,7 +433,7 @@ XenVssProvider::AreLunsSupported(
             *IsSupported = FALSE;
         }
         for (LONG Index = 0; Index < Count && *IsSupported; ++Index) {
-            if (!GetVdi(Luns[Index], NULL)) {
+            if (!GetVdi(*m_Store, Luns[Index], NULL)) {
                 Trace("Device \"%ws\" vetoed support\n", Devices[Index]);
                 *IsSupported = FALSE;
             }
@@ -392,8 +461,8 @@ XenVssProvider::BeginPrepareSnapshot(
     __inout VDS_LUN_INFORMATION*    Luns
     )
 {
-    HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    HRESULT         hr(S_OK);
+    PSNAPSHOT_SET   Set(NULL);
 
     Trace("====> (..., ..., %08x, %d, 0x%p, 0x%p)\n", Context, Count, Devices, Luns);
     TraceGUID(SetId);
@@ -419,40 +488,60 @@ XenVssProvider::BeginPrepareSnapshot(
             throw VSS_E_UNSUPPORTED_CONTEXT;
         }
 
-        switch (m_State) {
-        case VSS_SS_UNKNOWN:    
-            break;
-        case VSS_SS_PREPARING:  
-            if (!IsEqualGUID(SetId, m_SetId)) {
-                Trace("Invalid SetId {%s}\n", Guid(SetId));
-                throw VSS_E_PROVIDER_VETO;
-            }
-            break;
-        default:
-            Trace("Invalid State (%s)\n", __VssState(m_State));
+        GUID_VCT    Vdis;
+        BOOL_VCT    Found;
+        ResolveLuns(Count, Luns, Vdis, Found);
+
+        // snapshots of these VDIs may still be being torn down
+        WaitTeardown(Vdis);
+
+        Set = EnterSet(SetId, true);
+        if (Set == NULL) {
+            Trace("Set {%s} is being aborted\n", Guid(SetId).c_str());
             throw VSS_E_PROVIDER_VETO;
         }
-        
+        if (Set->State != VSS_SS_UNKNOWN && Set->State != VSS_SS_PREPARING) {
+            Trace("Invalid State (%s)\n", __VssState(Set->State));
+            throw VSS_E_PROVIDER_VETO;
+        }
+
+        AutoLock    Lock(m_CritSec);
+
+        // sets run in parallel only on disjoint VDIs
         for (LONG Index = 0; Index < Count; ++Index) {
-            GUID Vdi;
-            if (GetVdi(Luns[Index], &Vdi)) {
-                Trace("Adding VDI {%s}\n", Guid(Vdi).c_str());
-                m_Snapshots[Vdi] = GUID_NULL;
+            if (!Found[Index])
+                continue;
+            for (SNAPSHOT_SET_MAP::iterator it = m_Sets.begin(); it != m_Sets.end(); ++it) {
+                if (it->second != Set &&
+                    it->second->Snapshots.find(Vdis[Index]) != it->second->Snapshots.end()) {
+                    Trace("VDI {%s} is in set {%s}\n", Guid(Vdis[Index]).c_str(), Guid(it->first).c_str());
+                    throw VSS_E_PROVIDER_VETO;
+                }
             }
         }
 
-        m_SetId = SetId;
-        m_State = VSS_SS_PREPARING;
-        m_Context = Context;
+        for (LONG Index = 0; Index < Count; ++Index) {
+            if (Found[Index]) {
+                Trace("Adding VDI {%s}\n", Guid(Vdis[Index]).c_str());
+                Set->Snapshots[Vdis[Index]] = GUID_NULL;
+                Set->LunVdis[__LunKey(Luns[Index])] = Vdis[Index];
+            }
+        }
+
+        SetState(*Set, VSS_SS_PREPARING);
+        Set->Context = Context;
     } catch (HRESULT _hr) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
     } catch (...) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }
+    LeaveSet(Set);
     
     TraceHR(hr);
 
@@ -465,13 +554,11 @@ XenVssProvider::FillInLunInfo(
     __out BOOL*                     IsSupported
     )
 {
-    AutoLock    Lock(m_CritSec);
-
     Trace("====> (\"%ws\", 0x%p, 0x%p)\n", Device, Lun, IsSupported);
     TraceLun(NULL, *Lun);
 
     *IsSupported = FALSE;
-    if (IsVSSSupported() && GetVdi(*Lun, NULL)) {
+    if (IsVSSSupported() && GetVdi(*m_Store, *Lun, NULL)) {
         *IsSupported = TRUE;
     }
 
@@ -487,8 +574,9 @@ XenVssProvider::GetTargetLuns(
     __inout VDS_LUN_INFORMATION*    DstLuns
     )
 {
-    HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    HRESULT         hr(S_OK);
+    VSS_ID          SetId(GUID_NULL);
+    bool            Dom0(false);
 
     Trace("====> (%d, 0x%p, 0x%p, 0x%p)\n", Count, Devices, SrcLuns, DstLuns);
     for (LONG Index = 0; Index < Count; ++Index) {
@@ -496,39 +584,64 @@ XenVssProvider::GetTargetLuns(
         TraceLun("Src", SrcLuns[Index]);
     }
 
-    XenIfaceItf Store;
+    // VSS does not say which set, the LUNs do
+    {
+        AutoLock    Lock(m_CritSec);
+        PSNAPSHOT_SET Set = FindSetByLuns(Count, SrcLuns);
+        if (Set)
+            SetId = Set->SetId;
+    }
+
+    PSNAPSHOT_SET   Set(EnterSet(SetId, false));
     try {
-        if (m_State == VSS_SS_PROCESSING_POSTCOMMIT) {
-            Store.Remove(m_Vm + "/snapshot");
-            for (GUID_GUID_MAP::iterator it = m_Snapshots.begin(); it != m_Snapshots.end(); ++it) {
-                if (!IsEqualGUID(it->second, GUID_NULL)) {
-                    Store.Write(m_Vm + "/snapshot/" + Guid(it->second), "");
-                }
-            }
-            __SetWait(Store, m_Vm, CreateSnapshotInfo);
+        if (Set == NULL) {
+            Trace("No snapshot set for these LUNs\n");
+            throw VSS_E_PROVIDER_VETO;
+        }
+        TraceGUID(Set->SetId);
+
+        // normally collected by the worker PostCommitSnapshots started
+        HRESULT Prefetched = JoinPrefetch(*Set);
+        if (FAILED(Prefetched))
+            throw Prefetched;
+        if (Prefetched == S_FALSE) {
+            // only the inline prefetch talks to dom0; AbortSnapshots may be
+            // waiting for the set's Lock meanwhile
+            if (!m_Dom0->Acquire(Set->SetId, Set->Cancel))
+                throw XENVSS_E_CANCELLED;
+            Dom0 = true;
+
+            Prefetch(*Set, Set->State == VSS_SS_PROCESSING_POSTCOMMIT);
         }
 
-        string SnapInfo = Store.Read(m_Vm + "/snapinfo"); // appended to DeviceIdDescriptors
+        GUID_VCT    Vdis;
+        BOOL_VCT    Found;
+        LookupLuns(*Set, Count, SrcLuns, Vdis, Found);
 
         for (LONG Index = 0; Index < Count; ++Index) {
-            GUID Vdi;
-            if (GetVdi(SrcLuns[Index], &Vdi)) {
-                if (m_Snapshots.find(Vdi) != m_Snapshots.end()) {
-                    CloneLunInfo(DstLuns[Index], SrcLuns[Index], SnapInfo, Vdi, m_Snapshots[Vdi]);
+            const GUID& Vdi = Vdis[Index];
+            if (Found[Index]) {
+                if (Set->Snapshots.find(Vdi) != Set->Snapshots.end()) {
+                    CloneLunInfo(*Set, DstLuns[Index], SrcLuns[Index], Set->SnapInfo, Vdi, Set->Snapshots[Vdi]);
                 }
             }
         }
 
-        m_State = VSS_SS_CREATED;
+        SetState(*Set, VSS_SS_CREATED);
     } catch (HRESULT _hr) {
-        AbortSnapshots(GUID_NULL);
+        if (Set)
+            AbortSet(*Set);
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
     } catch (...) {
-        AbortSnapshots(GUID_NULL);
+        if (Set)
+            AbortSet(*Set);
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }    
+    if (Dom0)
+        m_Dom0->Release(SetId);
+    LeaveSet(Set);
 
     TraceHR(hr);
     return hr;
@@ -540,27 +653,34 @@ XenVssProvider::LocateLuns(
     )
 {
     HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    VSS_ID      Owner(__RequestId());
+    bool        Dom0(false);
 
     Trace("====> (%d, 0x%p)\n", Count, Luns);
     for (LONG Index = 0; Index < Count; ++Index) {
         TraceLun(NULL, Luns[Index]);
     }
 
-    XenIfaceItf Store;
+    XenIfaceItf& Store(*m_Store);
     try {
-        Store.Remove(m_Vm + "/snapshot");
+        XenIfaceBatch Request;
+        GUID_VCT      Vdis;
+        Request.Remove(m_Vm + "/snapshot");
 
-        LONG SnapCount = 0;
         for (LONG Index = 0; Index < Count; ++Index) {
             GUID Vdi;
-            if (GetVdi(Luns[Index], &Vdi)) {
-                Store.Write(m_Vm + "/snapshot/" + Guid(Vdi), "");
-                ++SnapCount;
+            if (GetVdi(Store, Luns[Index], &Vdi)) {
+                Request.Write(m_Vm + "/snapshot/" + Guid(Vdi), "");
+                Vdis.push_back(Vdi);
             }
         }
-        if (SnapCount) {
-            __SetWait(Store, m_Vm, ImportSnapshot);
+        if (!Vdis.empty()) {
+            // a snapshot still queued for teardown cannot be imported
+            WaitTeardown(Vdis);
+
+            m_Dom0->Acquire(Owner);
+            Dom0 = true;
+            __SetWait(Store, m_Vm, ImportSnapshot, m_Cancel, &Request);
         }
     } catch (HRESULT _hr) {
         hr = _hr;
@@ -569,7 +689,10 @@ XenVssProvider::LocateLuns(
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }    
-    TRY(Store.Remove(m_Vm + "/snapshot"));
+    if (Dom0) {
+        (VOID)Store.TryRemove(m_Vm + "/snapshot");
+        m_Dom0->Release(Owner);
+    }
 
     TraceHR(hr);
 
@@ -582,28 +705,30 @@ XenVssProvider::OnLunEmpty(
     )
 {
     HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
 
     Trace("====> (\"%ws\", 0x%p)\n", Device, Lun);
     TraceLun(NULL, *Lun);
 
-    XenIfaceItf Store;
+    XenIfaceItf& Store(*m_Store);
     try {
-        if (m_State != VSS_SS_UNKNOWN) {
-            Trace("Invalid State (%s)\n", __VssState(m_State));
-            throw VSS_E_PROVIDER_VETO;
+        {
+            AutoLock    Lock(m_CritSec);
+            for (SNAPSHOT_SET_MAP::iterator it = m_Sets.begin(); it != m_Sets.end(); ++it) {
+                if (it->second->State != VSS_SS_UNKNOWN) {
+                    Trace("Invalid State (%s) of set {%s}\n", __VssState(it->second->State), Guid(it->first).c_str());
+                    throw VSS_E_PROVIDER_VETO;
+                }
+            }
         }
 
         GUID        Vdi;
-        if (!GetVdi(*Lun, &Vdi)) {
+        if (!GetVdi(Store, *Lun, &Vdi)) {
             Trace("VDI Not Found\n");
             throw VSS_E_PROVIDER_VETO;
         }
 
-        Store.Remove(m_Vm + "/snapshot");
-        Store.Write(m_Vm + "/snapshot/" + Guid(Vdi), "");
-        TRY(__SetWait(Store, m_Vm, DeportSnapshot));
-        __SetWait(Store, m_Vm, DestroySnapshot);
+        // deported and destroyed by the teardown worker
+        QueueTeardown(Vdi, GUID_NULL);
     } catch (HRESULT _hr) {
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
@@ -611,9 +736,6 @@ XenVssProvider::OnLunEmpty(
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }
-    TRY(Store.Remove(m_Vm + "/snapshot"));
-    TRY(Store.Remove(m_Vm + "/snapinfo"));
-    TRY(Store.Remove(m_Vm + "/snapuuid"));
 
     TraceHR(hr);
 
@@ -695,34 +817,67 @@ XenVssProvider::EndPrepareSnapshots(
     __in VSS_ID                     SetId
     )
 {
-    HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    HRESULT         hr(S_OK);
+
+    m_Dom0->Acquire(SetId);
+    PSNAPSHOT_SET   Set(EnterSet(SetId, false));
     Trace("====> (...)\n");
     TraceGUID(SetId);
 
+    XenIfaceItf& Store(*m_Store);
     try {
         if (!m_IsVssSupported) {
             Trace("VSS support VETOed\n");
             throw VSS_E_PROVIDER_VETO;
         }
-        if (m_State != VSS_SS_PREPARING) {
-            Trace("Invalid State (%s)\n", __VssState(m_State));
+        if (Set == NULL) {
+            Trace("Invalid SetId {%s}\n", Guid(SetId).c_str());
             throw VSS_E_PROVIDER_VETO;
         }
-        if (!IsEqualGUID(SetId, m_SetId)) {
-            Trace("Invalid SetId {%s}\n", Guid(SetId));
+        if (Set->State != VSS_SS_PREPARING) {
+            Trace("Invalid State (%s)\n", __VssState(Set->State));
             throw VSS_E_PROVIDER_VETO;
         }
-        m_State = VSS_SS_PREPARED;
+
+        // stage the "create-snapshot" request before the freeze, so that
+        // CommitSnapshots only has to flip the status key
+        XenIfaceBatch Request;
+        ULONG         Count(0);
+        Request.Remove(m_Vm + "/snapshot");
+        for (GUID_GUID_MAP::iterator it = Set->Snapshots.begin(); it != Set->Snapshots.end(); ++it) {
+            if (!IsEqualGUID(it->first, GUID_NULL)) {
+                Request.Write(m_Vm + "/snapshot/" + Guid(it->first), "");
+                ++Count;
+            }
+        }
+        Store.Flush(Request);
+
+        if (Count) {
+            StringVct Staged = Store.Directory(m_Vm + "/snapshot");
+            if (Staged.size() != Count) {
+                Trace("Staged %d of %d VDIs\n", Staged.size(), Count);
+                throw E_FAIL;
+            }
+        }
+
+        // the staged request is this set's until PostCommitSnapshots has read the ids
+        m_Dom0->Acquire(SetId);
+        Set->Dom0 = true;
+
+        SetState(*Set, VSS_SS_PREPARED);
     } catch (HRESULT _hr) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
     } catch (...) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }
+    LeaveSet(Set);
+    m_Dom0->Release(SetId);
 
     TraceHR(hr);
     return hr;
@@ -732,8 +887,10 @@ XenVssProvider::PreCommitSnapshots(
     __in VSS_ID                     SetId
     )
 {
-    HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    HRESULT         hr(S_OK);
+
+    // no dom0 I/O, so never wait behind another set's request
+    PSNAPSHOT_SET   Set(EnterSet(SetId, false));
     Trace("====> (...)\n");
     TraceGUID(SetId);
 
@@ -742,24 +899,31 @@ XenVssProvider::PreCommitSnapshots(
             Trace("VSS support VETOed\n");
             throw VSS_E_PROVIDER_VETO;
         }
-        if (m_State != VSS_SS_PREPARED) {
-            Trace("Invalid State (%s)\n", __VssState(m_State));
+        if (Set == NULL) {
+            Trace("Invalid SetId {%s}\n", Guid(SetId).c_str());
             throw VSS_E_PROVIDER_VETO;
         }
-        if (!IsEqualGUID(SetId, m_SetId)) {
-            Trace("Invalid SetId {%s}\n", Guid(SetId));
+
+        // applications stay frozen from here until PostCommitSnapshots
+        Set->FreezeStart = StatsNow();
+
+        if (Set->State != VSS_SS_PREPARED) {
+            Trace("Invalid State (%s)\n", __VssState(Set->State));
             throw VSS_E_PROVIDER_VETO;
         }
-        m_State = VSS_SS_PRECOMMITTED;
+        SetState(*Set, VSS_SS_PRECOMMITTED);
     } catch (HRESULT _hr) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
     } catch (...) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }
+    LeaveSet(Set);
 
     TraceHR(hr);
     return hr;
@@ -769,52 +933,45 @@ XenVssProvider::CommitSnapshots(
     __in VSS_ID                     SetId
     )
 {
-    HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    HRESULT         hr(S_OK);
+
+    m_Dom0->Acquire(SetId);
+    PSNAPSHOT_SET   Set(EnterSet(SetId, false));
     Trace("====> (...)\n");
     TraceGUID(SetId);
 
-    XenIfaceItf Store;
+    XenIfaceItf& Store(*m_Store);
     try {
         if (!m_IsVssSupported) {
             Trace("VSS support VETOed\n");
             throw VSS_E_PROVIDER_VETO;
         }
-        if (m_State != VSS_SS_PRECOMMITTED) {
-            Trace("Invalid State (%s)\n", __VssState(m_State));
+        if (Set == NULL) {
+            Trace("Invalid SetId {%s}\n", Guid(SetId).c_str());
             throw VSS_E_PROVIDER_VETO;
         }
-        if (!IsEqualGUID(SetId, m_SetId)) {
-            Trace("Invalid SetId {%s}\n", Guid(SetId));
+        if (Set->State != VSS_SS_PRECOMMITTED) {
+            Trace("Invalid State (%s)\n", __VssState(Set->State));
             throw VSS_E_PROVIDER_VETO;
         }
 
-        // send "create-snapshot" command
-        Store.Remove(m_Vm + "/snapshot");
-        for (GUID_GUID_MAP::iterator it = m_Snapshots.begin(); it != m_Snapshots.end(); ++it) {
-            if (!IsEqualGUID(it->first, GUID_NULL)) {
-                Store.Write(m_Vm + "/snapshot/" + Guid(it->first), "");
-            }
-        }
-        __SetWait(Store, m_Vm, CreateSnapshot);
-
-        // "create-snapshot" succeeded
-        for (GUID_GUID_MAP::iterator it = m_Snapshots.begin(); it != m_Snapshots.end(); ++it) {
-            string value = Store.Read(m_Vm + "/snapshot/" + Guid(it->first) + "/id");
-            it->second = Guid(value);
-        }
+        // send "create-snapshot" command, the request was staged by EndPrepareSnapshots
+        __SetWait(Store, m_Vm, CreateSnapshot, Set->Cancel);
 
-        m_State = VSS_SS_COMMITTED;
+        SetState(*Set, VSS_SS_COMMITTED);
     } catch (HRESULT _hr) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
     } catch (...) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }
-    TRY(Store.Remove(m_Vm + "/snapshot"));
+    LeaveSet(Set);
+    m_Dom0->Release(SetId);
 
     TraceHR(hr);
     return hr;
@@ -825,34 +982,59 @@ XenVssProvider::PostCommitSnapshots(
     __in LONG                       Count
     )
 {
-    HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    HRESULT         hr(S_OK);
+
+    m_Dom0->Acquire(SetId);
+    PSNAPSHOT_SET   Set(EnterSet(SetId, false));
     Trace("====> (..., %d)\n", Count);
     TraceGUID(SetId);
 
+    XenIfaceItf& Store(*m_Store);
     try {
         if (!m_IsVssSupported) {
             Trace("VSS support VETOed\n");
             throw VSS_E_PROVIDER_VETO;
         }
-        if (m_State != VSS_SS_COMMITTED) {
-            Trace("Invalid State (%s)\n", __VssState(m_State));
+        if (Set == NULL) {
+            Trace("Invalid SetId {%s}\n", Guid(SetId).c_str());
             throw VSS_E_PROVIDER_VETO;
         }
-        if (!IsEqualGUID(SetId, m_SetId)) {
-            Trace("Invalid SetId {%s}\n", Guid(SetId));
+
+        // the application freeze started at PreCommitSnapshots
+        if (Set->FreezeStart != 0)
+            StatsRecordFreeze(StatsElapsed(Set->FreezeStart));
+        Set->FreezeStart = 0;
+
+        if (Set->State != VSS_SS_COMMITTED) {
+            Trace("Invalid State (%s)\n", __VssState(Set->State));
             throw VSS_E_PROVIDER_VETO;
         }
-        m_State = VSS_SS_PROCESSING_POSTCOMMIT;
+
+        // "create-snapshot" succeeded, collect the snapshot VDIs now the freeze is over
+        ReadSnapshotIds(*Set, true);
+        (VOID)Store.TryRemove(m_Vm + "/snapshot");
+
+        SetState(*Set, VSS_SS_PROCESSING_POSTCOMMIT);
+
+        // the snapshot info is collected while VSS carries on with the thaw
+        StartPrefetch(*Set);
+
+        // the prefetch worker has its own hold on dom0
+        Set->Dom0 = false;
+        m_Dom0->Release(SetId);
     } catch (HRESULT _hr) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
     } catch (...) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }
+    LeaveSet(Set);
+    m_Dom0->Release(SetId);
 
     TraceHR(hr);
     return hr;
@@ -862,8 +1044,10 @@ XenVssProvider::PreFinalCommitSnapshots(
     __in VSS_ID                     SetId
     )
 {
-    HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    HRESULT         hr(S_OK);
+
+    // no dom0 I/O, so never wait behind another set's request
+    PSNAPSHOT_SET   Set(EnterSet(SetId, false));
     Trace("====> (...)\n");
     TraceGUID(SetId);
 
@@ -872,24 +1056,27 @@ XenVssProvider::PreFinalCommitSnapshots(
             Trace("VSS support VETOed\n");
             throw VSS_E_PROVIDER_VETO;
         }
-        if (m_State != VSS_SS_CREATED) {
-            Trace("Invalid State (%s)\n", __VssState(m_State));
+        if (Set == NULL) {
+            Trace("Invalid SetId {%s}\n", Guid(SetId).c_str());
             throw VSS_E_PROVIDER_VETO;
         }
-        if (!IsEqualGUID(SetId, m_SetId)) {
-            Trace("Invalid SetId {%s}\n", Guid(SetId));
+        if (Set->State != VSS_SS_CREATED) {
+            Trace("Invalid State (%s)\n", __VssState(Set->State));
             throw VSS_E_PROVIDER_VETO;
         }
-        m_State = VSS_SS_CREATED;
+        SetState(*Set, VSS_SS_CREATED);
     } catch (HRESULT _hr) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
     } catch (...) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }
+    LeaveSet(Set);
 
     TraceHR(hr);
     return hr;
@@ -899,39 +1086,51 @@ XenVssProvider::PostFinalCommitSnapshots(
     __in VSS_ID                     SetId
     )
 {
-    HRESULT     hr(S_OK);
-    AutoLock    Lock(m_CritSec);
+    HRESULT         hr(S_OK);
+
+    // nothing is asked of dom0, so never wait behind another set's request
+    PSNAPSHOT_SET   Set(EnterSet(SetId, false));
     Trace("====> (...)\n");
     TraceGUID(SetId);
 
-    XenIfaceItf Store;
+    XenIfaceItf& Store(*m_Store);
     try {
         if (!m_IsVssSupported) {
             Trace("VSS support VETOed\n");
             throw VSS_E_PROVIDER_VETO;
         }
-        if (m_State != VSS_SS_CREATED) {
-            Trace("Invalid State (%s)\n", __VssState(m_State));
+        if (Set == NULL) {
+            Trace("Invalid SetId {%s}\n", Guid(SetId).c_str());
             throw VSS_E_PROVIDER_VETO;
         }
-        if (!IsEqualGUID(SetId, m_SetId)) {
-            Trace("Invalid SetId {%s}\n", Guid(SetId));
+        if (Set->State != VSS_SS_CREATED) {
+            Trace("Invalid State (%s)\n", __VssState(Set->State));
             throw VSS_E_PROVIDER_VETO;
         }
-        m_State = VSS_SS_UNKNOWN;
-        m_SetId = GUID_NULL;
-        m_Context = 0;
-        m_Snapshots.clear();
+        SetState(*Set, VSS_SS_UNKNOWN);
+        DeleteSet(Set);
     } catch (HRESULT _hr) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = _hr;
         Trace("Exception %s:%08x\n", __HR(hr), hr);
     } catch (...) {
-        AbortSnapshots(SetId);
+        if (Set)
+            AbortSet(*Set);
         hr = E_UNEXPECTED;
         Trace("Exception E_UNEXPECTED\n");
     }
-    TRY(Store.Remove(m_Vm + "/snapshot"));
+    // /snapshot may hold another set's staged request unless dom0 is free
+    if (m_Dom0->TryAcquire(SetId)) {
+        (VOID)Store.TryRemove(m_Vm + "/snapshot");
+        m_Dom0->Release(SetId);
+    }
+    LeaveSet(Set);
+
+    ULONG Queries, Ioctls;
+    Store.Stats(&Queries, &Ioctls);
+    Trace("%u store ioctls for %u reads\n", Ioctls, Queries);
+    StatsDump();
 
     TraceHR(hr);
     return hr;
@@ -941,33 +1140,21 @@ XenVssProvider::AbortSnapshots(
     __in VSS_ID                     SetId
     )
 {
-    AutoLock    Lock(m_CritSec);
-    ULONG       SnapshotCount(0);
+    // wake any dom0 wait of the set in progress, it holds the set's Lock
+    CancelSet(SetId);
+
+    // AbortSet only takes dom0 if it is free, the teardown worker may hold it
+    // for minutes and VSS must not wait for that
+    PSNAPSHOT_SET   Set(EnterSet(SetId, false));
     Trace("====> (...)\n");
     TraceGUID(SetId);
 
-    XenIfaceItf Store;
+    if (Set)
+        AbortSet(*Set);
+    else
+        Trace("No snapshot set {%s}\n", Guid(SetId).c_str());
+    LeaveSet(Set);
 
-    TRY(Store.Remove(m_Vm + "/snapshot"));
-    for (GUID_GUID_MAP::iterator it = m_Snapshots.begin(); it != m_Snapshots.end(); ++it) {
-        if (!IsEqualGUID(it->second, GUID_NULL)) {
-            TRY(Store.Write(m_Vm + "/snapshot/" + Guid(it->second), ""));
-            ++SnapshotCount;
-        }
-    }
-    if (SnapshotCount) {
-        TRY(__SetWait(Store, m_Vm, DeportSnapshot));
-        TRY(__SetWait(Store, m_Vm, DestroySnapshot));
-    }
-    TRY(Store.Remove(m_Vm + "/snapshot"));
-    TRY(Store.Remove(m_Vm + "/snapinfo"));
-    TRY(Store.Remove(m_Vm + "/snapuuid"));
-
-    m_Snapshots.clear();
-    m_State = VSS_SS_UNKNOWN;
-    m_SetId = GUID_NULL;
-    m_Context = 0;
-        
     TraceHR(S_OK);
     return S_OK;
 }
@@ -1002,55 +1189,67 @@ bool
 XenVssProvider::IsVSSSupported(
     )
 {
-    XenIfaceItf Store;
-    m_IsVssSupported = true;
-
-    try {
-        string value = Store.Read("vm-data/allowvssprovider");
+    AutoLock    Lock(m_PolicyLock);
+
+    // the key rarely changes, re-read it only when the watch fires, which
+    // includes a reconnect that lost the watch; without a watch the value
+    // is trusted for POLICY_TTL
+    if (m_PolicyWatch->Fired())
+        m_PolicyRead = 0;
+    if (m_PolicyRead != 0 &&
+        (m_PolicyWatch->Active() || StatsElapsed(m_PolicyRead) < POLICY_TTL))
+        return m_IsVssSupported;
+
+    XenIfaceItf& Store(*m_Store);
+    bool Supported = true;
+
+    // the policy key is usually absent, which allows the provider
+    string value;
+    HRESULT hr = Store.TryRead("vm-data/allowvssprovider", &value);
+    if (SUCCEEDED(hr)) {
         Trace("vm-data/allowvssprovider = %s\n", value.c_str());
-        m_IsVssSupported = __StringToBool(value);
-        if (!m_IsVssSupported) {
-            // remove vss data, so agent doesnt use stale data
-            TRY(Store.Remove(m_Vm + "/snapshot"));
-            TRY(Store.Remove(m_Vm + "/snapinfo"));
-            TRY(Store.Remove(m_Vm + "/snapuuid"));
-        }
-    } catch (HRESULT hr) {
-        Trace("Exception %s:%08x\n", __HR(hr), hr);
-    } catch (...) {
-        Trace("Exception UNKNOWN\n");
+        Supported = __StringToBool(value);
+    } else {
+        Trace("vm-data/allowvssprovider %s:%08x\n", __HR(hr), hr);
     }
+    m_PolicyRead = StatsNow();
+
+    if (m_IsVssSupported && !Supported) {
+        // remove vss data, so agent doesnt use stale data
+        (VOID)Store.TryRemove(m_Vm + "/snapshot");
+        (VOID)Store.TryRemove(m_Vm + "/snapinfo");
+        (VOID)Store.TryRemove(m_Vm + "/snapuuid");
+    }
+    m_IsVssSupported = Supported;
 
     Trace("%s\n", m_IsVssSupported ? "SUPPORTED" : "NOT_SUPPORTED");
     return m_IsVssSupported;
 }
 bool 
 XenVssProvider::CloneLunInfo(
+    const SNAPSHOT_SET&         Set,
     VDS_LUN_INFORMATION&        Dst, 
     const VDS_LUN_INFORMATION&  Src,
     const string&               SnapInfo, // XML
     const GUID&                 SrcVdi,   // VDI of current disk
     const GUID&                 DstVdi)   // VDI of snapshot disk
 {
-    XenIfaceItf Store;
     try {
         ULONG  i;
         ULONG  Identifiers;
 
-        Bytes  Page80;
-        string Page80Base64;
-        string SerialNumber;
-
-        Page80Base64 = Store.Read(m_Vm + "/snapshot/" + Guid(DstVdi) + "/scsi/0x12/0x80");
-        Page80.FromBase64(Page80Base64);
-        SerialNumber.assign((const char*)Page80.Ptr(4), Page80.Length() - 4);
-        rtrim(SerialNumber);
-
-        Bytes  Page83;
-        string Page83Base64;
+        SNAPSHOT_PAGES_MAP::const_iterator Pages = Set.Pages.find(DstVdi);
+        if (Pages == Set.Pages.end()) {
+            Trace("No pages for {%s}\n", Guid(DstVdi).c_str());
+            throw HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+        }
 
-        Page83Base64 = Store.Read(m_Vm + "/snapshot/" + Guid(DstVdi) + "/scsi/0x12/0x83");
-        Page83.FromBase64(Page83Base64);
+        BytesView   SerialNumber;
+        Base64View  Page83(Pages->second.Page83);
+        if (!__VpdSerialNumber(Pages->second.Page80, &SerialNumber)) {
+            Trace("Invalid page 0x80 for {%s}\n", Guid(DstVdi).c_str());
+            throw E_INVALIDARG;
+        }
 
         Dst.m_version            = VER_VDS_LUN_INFORMATION;
         Dst.m_DeviceType         = Src.m_DeviceType;
@@ -1062,8 +1261,10 @@ XenVssProvider::CloneLunInfo(
         Dst.m_szProductRevision  = (char*)Clone(Src.m_szProductRevision, strlen(Src.m_szProductRevision) + 1);
         if (m_UseSrcSerialNumber)
             Dst.m_szSerialNumber = (char*)Clone(Src.m_szSerialNumber, strlen(Src.m_szSerialNumber) + 1);
-        else
-            Dst.m_szSerialNumber = (char*)Clone(SerialNumber.c_str(), SerialNumber.length() + 1);
+        else {
+            Dst.m_szSerialNumber = (char*)Clone(NULL, SerialNumber.Length() + 1);
+            ::CopyMemory(Dst.m_szSerialNumber, SerialNumber.Ptr(), SerialNumber.Length());
+        }
         Dst.m_diskSignature      = DstVdi;
         Dst.m_cInterconnects     = 0;
         Dst.m_rgInterconnects    = NULL;
@@ -1085,7 +1286,7 @@ XenVssProvider::CloneLunInfo(
                 string Uuid = Guid(DstVdi);
                 DstId.m_cbIdentifier = Uuid.length();
                 DstId.m_rgbIdentifier = (BYTE*)Clone(&Uuid[0], Uuid.length());
-            } else if (!__CloneFromPage83(DstId, Page83)) {
+            } else if (!__CloneFromPage83(DstId, Pages->second.Page83Index, Page83)) {
                 // failed to clone from Page83Data, clone from Src as fallback
                 DstId.m_cbIdentifier = SrcId.m_cbIdentifier;
                 DstId.m_rgbIdentifier = (BYTE*)Clone(SrcId.m_rgbIdentifier, SrcId.m_cbIdentifier);
@@ -1108,4 +1309,701 @@ XenVssProvider::CloneLunInfo(
         return false;
     }
 }
+bool
+XenVssProvider::GetVdi(
+    XenIfaceItf&                Store,
+    const VDS_LUN_INFORMATION&  Lun, 
+    GUID*                       Vdi
+    ) 
+{
+    for (ULONG i = 0; i < Lun.m_deviceIdDescriptor.m_cIdentifiers; ++i) {
+        const VDS_STORAGE_IDENTIFIER* Id = &Lun.m_deviceIdDescriptor.m_rgIdentifiers[i];
+        if (__IsTargetId(*Id)) {
+            if (Vdi) {
+                string targetid = trim(string((const char*)Id->m_rgbIdentifier, 4));
+                try {
+                    *Vdi = ResolveTarget(Store, targetid);
+                } catch (...) {
+                    Trace("Exception trying to find vdi-uuid for target %s\n", targetid.c_str());
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+    for (ULONG i = 0; i < Lun.m_deviceIdDescriptor.m_cIdentifiers; ++i) {
+        const VDS_STORAGE_IDENTIFIER* Id = &Lun.m_deviceIdDescriptor.m_rgIdentifiers[i];
+        if (__IsVdiUuid(*Id)) {
+            if (Vdi) {
+                *Vdi = Guid(string((const char*)Id->m_rgbIdentifier, 36));
+            }
+            return true;
+        }
+    }
+    return false;
+}
+GUID
+XenVssProvider::ResolveTarget(
+    XenIfaceItf&                Store,
+    const string&               TargetId
+    )
+{
+    char        path[MAX_PATH];
+    GUID        Vdi;
+
+    if (CachedTarget(TargetId, &Vdi))
+        return Vdi;
+
+    _snprintf_s(path, sizeof(path), MAX_PATH-1,
+                "data/scsi/target/%s/frontend",
+                TargetId.c_str());
+    string frontend = Store.Read(path);
+
+    _snprintf_s(path, sizeof(path), MAX_PATH-1,
+                "%s/backend",
+                frontend.c_str());
+    string backend = Store.Read(path);
+
+    _snprintf_s(path, sizeof(path), MAX_PATH-1,
+                "%s/sm-data/vdi-uuid",
+                backend.c_str());
+    string vdiuuid = Store.Read(path);
+
+    Vdi = Guid(vdiuuid);
+
+    // a VBD re-plugged with another VDI keeps its target id and frontend,
+    // so only a watch on the targets can tell that a cached VDI is stale
+    AutoLock    Lock(m_TargetLock);
+    if (m_TargetWatch->Active())
+        m_TargetVdis[TargetId] = Vdi;
+    return Vdi;
+}
+bool
+XenVssProvider::CachedTarget(
+    const string&               TargetId,
+    GUID*                       Vdi
+    )
+{
+    AutoLock    Lock(m_TargetLock);
+
+    // a VBD was plugged or unplugged, or a reconnect may have hidden
+    // that, so every cached target is suspect
+    if (m_TargetWatch->Fired() || !m_TargetWatch->Active())
+        m_TargetVdis.clear();
+
+    TARGET_VDI_MAP::iterator it = m_TargetVdis.find(TargetId);
+    if (it == m_TargetVdis.end())
+        return false;
+
+    *Vdi = it->second;
+    return true;
+}
+// as GetVdi, for the LUNs that need no store reads
+bool
+XenVssProvider::GetCachedVdi(
+    const VDS_LUN_INFORMATION&  Lun,
+    GUID*                       Vdi,
+    BOOL*                       Found
+    )
+{
+    for (ULONG i = 0; i < Lun.m_deviceIdDescriptor.m_cIdentifiers; ++i) {
+        const VDS_STORAGE_IDENTIFIER* Id = &Lun.m_deviceIdDescriptor.m_rgIdentifiers[i];
+        if (__IsTargetId(*Id)) {
+            if (!CachedTarget(trim(string((const char*)Id->m_rgbIdentifier, 4)), Vdi))
+                return false;
+            *Found = TRUE;
+            return true;
+        }
+    }
+    *Found = GetVdi(*m_Store, Lun, Vdi) ? TRUE : FALSE;
+    return true;
+}
+
+typedef struct _RESOLVE_CONTEXT {
+    XenVssProvider*         Provider;
+    const LONG*             Indexes;    // of the LUNs to resolve
+    VDS_LUN_INFORMATION*    Luns;
+    GUID*                   Vdis;
+    BOOL*                   Found;
+} RESOLVE_CONTEXT, *PRESOLVE_CONTEXT;
+
+void
+XenVssProvider::ResolveLuns(
+    LONG                        Count,
+    VDS_LUN_INFORMATION*        Luns,
+    GUID_VCT&                   Vdis,
+    BOOL_VCT&                   Found
+    )
+{
+    vector<LONG>    Missed;
+    RESOLVE_CONTEXT Context;
+
+    Vdis.assign(Count, GUID_NULL);
+    Found.assign(Count, FALSE);
+
+    // a LUN the target cache can answer never reaches the helpers
+    for (LONG Index = 0; Index < Count; ++Index) {
+        if (!GetCachedVdi(Luns[Index], &Vdis[Index], &Found[Index]))
+            Missed.push_back(Index);
+    }
+    if (Missed.empty())
+        return;
+
+    Context.Provider    = this;
+    Context.Indexes     = &Missed[0];
+    Context.Luns        = Luns;
+    Context.Vdis        = &Vdis[0];
+    Context.Found       = &Found[0];
+
+    LONG Helpers = m_Resolvers->Run(*m_Store, (LONG)Missed.size(), ResolveLun, &Context);
+    Trace("Resolved %d of %d LUNs with %d helper threads\n", (LONG)Missed.size(), Count, Helpers);
+}
+void
+XenVssProvider::ResolveLun(
+    XenIfaceItf&                Store,
+    LONG                        Next,
+    PVOID                       Argument
+    )
+{
+    PRESOLVE_CONTEXT Context = (PRESOLVE_CONTEXT)Argument;
+    LONG             Index = Context->Indexes[Next];
+
+    Context->Found[Index] = Context->Provider->GetVdi(Store, Context->Luns[Index], &Context->Vdis[Index]) ? TRUE : FALSE;
+}
+void
+XenVssProvider::LookupLuns(
+    SNAPSHOT_SET&               Set,
+    LONG                        Count,
+    VDS_LUN_INFORMATION*        Luns,
+    GUID_VCT&                   Vdis,
+    BOOL_VCT&                   Found
+    )
+{
+    vector<VDS_LUN_INFORMATION> Missed;
+    vector<LONG>                MissedIndex;
+
+    Vdis.assign(Count, GUID_NULL);
+    Found.assign(Count, FALSE);
+    for (LONG Index = 0; Index < Count; ++Index) {
+        LUN_VDI_MAP::const_iterator it = Set.LunVdis.find(__LunKey(Luns[Index]));
+        if (it != Set.LunVdis.end()) {
+            Vdis[Index] = it->second;
+            Found[Index] = TRUE;
+        } else {
+            Missed.push_back(Luns[Index]);
+            MissedIndex.push_back(Index);
+        }
+    }
+    if (Missed.empty())
+        return;
+
+    // not seen by BeginPrepareSnapshot, resolve through the store
+    GUID_VCT    MissedVdis;
+    BOOL_VCT    MissedFound;
+    ResolveLuns((LONG)Missed.size(), &Missed[0], MissedVdis, MissedFound);
+    for (size_t i = 0; i < Missed.size(); ++i) {
+        Vdis[MissedIndex[i]] = MissedVdis[i];
+        Found[MissedIndex[i]] = MissedFound[i];
+    }
+    Trace("%d of %d LUNs resolved through the store\n", (LONG)Missed.size(), Count);
+}
+void
+XenVssProvider::Prefetch(
+    SNAPSHOT_SET&               Set,
+    bool                        CreateInfo
+    )
+{
+    XenIfaceItf& Store(*m_Store);
+
+    if (CreateInfo) {
+        XenIfaceBatch Request;
+        Request.Remove(m_Vm + "/snapshot");
+        for (GUID_GUID_MAP::iterator it = Set.Snapshots.begin(); it != Set.Snapshots.end(); ++it) {
+            if (!IsEqualGUID(it->second, GUID_NULL)) {
+                Request.Write(m_Vm + "/snapshot/" + Guid(it->second), "");
+            }
+        }
+        __SetWait(Store, m_Vm, CreateSnapshotInfo, Set.Cancel, &Request);
+    }
 
+    // snapinfo and the inquiry pages of every snapshot, nothing else
+    Set.SnapInfo = Store.Read(m_Vm + "/snapinfo"); // appended to DeviceIdDescriptors
+    Set.Pages.clear();
+    for (GUID_GUID_MAP::iterator it = Set.Snapshots.begin(); it != Set.Snapshots.end(); ++it) {
+        if (IsEqualGUID(it->second, GUID_NULL))
+            continue;
+
+        // a snapshot without pages is left for CloneLunInfo to report
+        try {
+            string          Scsi = m_Vm + "/snapshot/" + Guid(it->second) + "/scsi/0x12/";
+            SNAPSHOT_PAGES  Pages;
+            BytesView       SerialNumber;
+
+            Pages.Page80.FromBase64(Store.Read(Scsi + "0x80"));
+            if (!__VpdSerialNumber(Pages.Page80, &SerialNumber)) {
+                Trace("Invalid page 0x80 for {%s}\n", Guid(it->second).c_str());
+                continue;
+            }
+
+            // page 0x83 stays base64, identifiers are decoded as they are cloned
+            Pages.Page83 = Store.Read(Scsi + "0x83");
+            if (!__IndexPage83(Base64View(Pages.Page83), Pages.Page83Index))
+                Trace("Invalid page 0x83 for {%s}\n", Guid(it->second).c_str());
+
+            SNAPSHOT_PAGES& Entry = Set.Pages[it->second];
+            Entry.Page80 = std::move(Pages.Page80);
+            Entry.Page83.swap(Pages.Page83);
+            Entry.Page83Index.swap(Pages.Page83Index);
+        } catch (...) {
+            Trace("Failed to decode pages for {%s}\n", Guid(it->second).c_str());
+        }
+    }
+}
+void
+XenVssProvider::StartPrefetch(
+    SNAPSHOT_SET&               Set
+    )
+{
+    JoinPrefetch(Set);
+
+    // the worker holds dom0 for the set until it is done
+    m_Dom0->Acquire(Set.SetId);
+
+    Set.PrefetchResult = S_OK;
+    Set.Prefetch = CreateThread(NULL, 0, PrefetchThread, &Set, 0, NULL);
+    if (Set.Prefetch == NULL) {
+        Trace("CreateThread failed (%d), GetTargetLuns will collect the snapshot info\n", GetLastError());
+        m_Dom0->Release(Set.SetId);
+    }
+}
+// S_FALSE when no worker was running
+HRESULT
+XenVssProvider::JoinPrefetch(
+    SNAPSHOT_SET&               Set
+    )
+{
+    if (Set.Prefetch == NULL)
+        return S_FALSE;
+
+    WaitForSingleObject(Set.Prefetch, INFINITE);
+    CloseHandle(Set.Prefetch);
+    Set.Prefetch = NULL;
+    return Set.PrefetchResult;
+}
+DWORD WINAPI
+XenVssProvider::PrefetchThread(
+    PVOID                       Argument
+    )
+{
+    PSNAPSHOT_SET   Set = (PSNAPSHOT_SET)Argument;
+    XenVssProvider* Provider = Set->Provider;
+
+    // the set is left alone until JoinPrefetch, which every other user calls first
+    try {
+        Provider->Prefetch(*Set, true);
+    } catch (HRESULT hr) {
+        Trace("Exception %s:%08x\n", __HR(hr), hr);
+        Set->PrefetchResult = hr;
+    } catch (...) {
+        Trace("Exception E_UNEXPECTED\n");
+        Set->PrefetchResult = E_UNEXPECTED;
+    }
+    Provider->m_Dom0->Release(Set->SetId);
+    return 0;
+}
+void
+XenVssProvider::SetState(
+    SNAPSHOT_SET&               Set,
+    VSS_SNAPSHOT_STATE          State
+    )
+{
+    AutoLock    Lock(m_CritSec);
+    ULONGLONG   Now = StatsNow();
+
+    if (Set.State != VSS_SS_UNKNOWN)
+        StatsRecordState(Set.State, (ULONG)((Now - Set.StateStart) / 1000));
+    if (State == VSS_SS_UNKNOWN)
+        Set.FreezeStart = 0;
+
+    Set.State = State;
+    Set.StateStart = Now;
+}
+PSNAPSHOT_SET
+XenVssProvider::FindSet(
+    const VSS_ID&               SetId
+    )
+{
+    SNAPSHOT_SET_MAP::iterator it = m_Sets.find(SetId);
+    if (it == m_Sets.end())
+        return NULL;
+    return it->second;
+}
+// the set that prepared any of the LUNs, or failing that the only set
+// waiting for GetTargetLuns
+PSNAPSHOT_SET
+XenVssProvider::FindSetByLuns(
+    LONG                        Count,
+    VDS_LUN_INFORMATION*        Luns
+    )
+{
+    PSNAPSHOT_SET   Waiting(NULL);
+    ULONG           WaitingCount(0);
+
+    for (SNAPSHOT_SET_MAP::iterator it = m_Sets.begin(); it != m_Sets.end(); ++it) {
+        PSNAPSHOT_SET Set = it->second;
+
+        for (LONG Index = 0; Index < Count; ++Index) {
+            if (Set->LunVdis.find(__LunKey(Luns[Index])) != Set->LunVdis.end())
+                return Set;
+        }
+        if (Set->State == VSS_SS_PROCESSING_POSTCOMMIT ||
+            Set->State == VSS_SS_CREATED) {
+            Waiting = Set;
+            ++WaitingCount;
+        }
+    }
+    return (WaitingCount == 1) ? Waiting : NULL;
+}
+PSNAPSHOT_SET
+XenVssProvider::CreateSet(
+    const VSS_ID&               SetId
+    )
+{
+    PSNAPSHOT_SET Set = new SNAPSHOT_SET;
+
+    Set->Provider = this;
+    Set->SetId = SetId;
+    Set->References = 1;
+    Set->Deleted = false;
+    Set->State = VSS_SS_UNKNOWN;
+    Set->Context = 0;
+    Set->Cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    Set->Dom0 = false;
+    Set->StateStart = StatsNow();
+    Set->FreezeStart = 0;
+    Set->Prefetch = NULL;
+    Set->PrefetchResult = S_OK;
+    if (Set->Cancel == NULL) {
+        delete Set;
+        throw HRESULT_FROM_WIN32(GetLastError());
+    }
+    InitializeCriticalSection(&Set->Lock);
+
+    m_Sets[SetId] = Set;
+    Trace("Set {%s} created, %d sets\n", Guid(SetId).c_str(), (ULONG)m_Sets.size());
+    return Set;
+}
+void
+XenVssProvider::DeleteSet(
+    PSNAPSHOT_SET               Set
+    )
+{
+    JoinPrefetch(*Set);
+    {
+        AutoLock    Lock(m_CritSec);
+        if (Set->Deleted)
+            return;
+        m_Sets.erase(Set->SetId);
+        Set->Deleted = true;
+    }
+    DereferenceSet(Set);
+}
+// finds the set, or creates it, and waits for any other callback of the set
+// to finish; NULL if the set is gone by then
+PSNAPSHOT_SET
+XenVssProvider::EnterSet(
+    const VSS_ID&               SetId,
+    bool                        Create
+    )
+{
+    PSNAPSHOT_SET   Set;
+    {
+        AutoLock    Lock(m_CritSec);
+        Set = FindSet(SetId);
+        if (Set == NULL && Create)
+            Set = CreateSet(SetId);
+        if (Set == NULL)
+            return NULL;
+        ++Set->References;
+    }
+
+    EnterCriticalSection(&Set->Lock);
+    if (Set->Deleted) {
+        LeaveSet(Set);
+        return NULL;
+    }
+    return Set;
+}
+void
+XenVssProvider::LeaveSet(
+    PSNAPSHOT_SET               Set
+    )
+{
+    if (Set == NULL)
+        return;
+
+    LeaveCriticalSection(&Set->Lock);
+    DereferenceSet(Set);
+}
+void
+XenVssProvider::DereferenceSet(
+    PSNAPSHOT_SET               Set
+    )
+{
+    {
+        AutoLock    Lock(m_CritSec);
+        if (--Set->References != 0)
+            return;
+    }
+
+    DeleteCriticalSection(&Set->Lock);
+    CloseHandle(Set->Cancel);
+    delete Set;
+}
+// wakes the set's dom0 wait in progress, without waiting for its Lock
+void
+XenVssProvider::CancelSet(
+    const VSS_ID&               SetId
+    )
+{
+    AutoLock    Lock(m_CritSec);
+
+    SNAPSHOT_SET_MAP::iterator it = m_Sets.find(SetId);
+    if (it != m_Sets.end())
+        SetEvent(it->second->Cancel);
+}
+// tears down whatever the set created in dom0 and removes it from m_Sets,
+// the caller's reference keeps it valid until LeaveSet
+void
+XenVssProvider::AbortSet(
+    SNAPSHOT_SET&               Set
+    )
+{
+    VSS_ID      SetId(Set.SetId);
+
+    TraceGUID(SetId);
+
+    // the prefetch worker waits on dom0 too, it must be gone before the
+    // snapshots are torn down
+    JoinPrefetch(Set);
+
+    // only waits started before this point are cancelled
+    ResetEvent(Set.Cancel);
+
+    // never wait for dom0 here, callers hold the set's Lock; a set that does not
+    // hold it has nothing staged in dom0
+    if (m_Dom0->TryAcquire(SetId)) {
+        XenIfaceItf& Store(*m_Store);
+
+        // dom0 has created the snapshots but PostCommitSnapshots has not read
+        // their ids, or CommitSnapshots gave up on "create-snapshots" and dom0
+        // may have created some; /snapshot is the only record of them
+        if (Set.State == VSS_SS_PRECOMMITTED || Set.State == VSS_SS_COMMITTED)
+            TRY(ReadSnapshotIds(Set, false));
+
+        (VOID)Store.TryRemove(m_Vm + "/snapshot");
+        (VOID)Store.TryRemove(m_Vm + "/snapinfo");
+        (VOID)Store.TryRemove(m_Vm + "/snapuuid");
+
+        if (Set.Dom0) {
+            Set.Dom0 = false;
+            m_Dom0->Release(SetId);
+        }
+        m_Dom0->Release(SetId);
+    }
+
+    // deported and destroyed by the teardown worker, so the failing call
+    // returns to VSS without waiting for dom0
+    for (GUID_GUID_MAP::iterator it = Set.Snapshots.begin(); it != Set.Snapshots.end(); ++it) {
+        if (!IsEqualGUID(it->second, GUID_NULL))
+            QueueTeardown(it->second, it->first);
+    }
+
+    if (Set.State != VSS_SS_UNKNOWN) {
+        SetState(Set, VSS_SS_UNKNOWN);
+        StatsDump();
+    }
+    DeleteSet(&Set);
+}
+void
+XenVssProvider::ReadSnapshotIds(
+    SNAPSHOT_SET&               Set,
+    bool                        Required
+    )
+{
+    XenIfaceItf&    Store(*m_Store);
+    GUID_GUID_MAP   Ids;
+
+    // the store is read outside m_CritSec
+    for (GUID_GUID_MAP::iterator it = Set.Snapshots.begin(); it != Set.Snapshots.end(); ++it) {
+        string  value;
+        HRESULT hr;
+
+        if (IsEqualGUID(it->first, GUID_NULL) || !IsEqualGUID(it->second, GUID_NULL))
+            continue;
+
+        hr = Store.TryRead(m_Vm + "/snapshot/" + Guid(it->first) + "/id", &value);
+        if (FAILED(hr)) {
+            if (Required)
+                throw hr;
+            continue;
+        }
+        Trace("VDI {%s} has snapshot %s\n", Guid(it->first).c_str(), value.c_str());
+        Ids[it->first] = Guid(value);
+    }
+
+    AutoLock    Lock(m_CritSec);
+    for (GUID_GUID_MAP::iterator it = Ids.begin(); it != Ids.end(); ++it)
+        Set.Snapshots[it->first] = it->second;
+}
+// callers hold m_TeardownLock
+void
+XenVssProvider::StartTeardown(
+    )
+{
+    if (m_TeardownThread != NULL)
+        return;
+
+    m_TeardownThread = CreateThread(NULL, 0, TeardownThread, this, 0, NULL);
+    if (m_TeardownThread == NULL) {
+        Trace("CreateThread failed (%d), teardown stays queued\n", GetLastError());
+        return;
+    }
+    SetEvent(m_TeardownQueued);
+}
+void
+XenVssProvider::QueueTeardown(
+    const GUID&                 Snapshot,
+    const GUID&                 Source
+    )
+{
+    AutoLock    Lock(m_TeardownLock);
+
+    Trace("Snapshot {%s} queued for teardown\n", Guid(Snapshot).c_str());
+    m_TeardownVdis[Snapshot] = Source;
+    __SaveTeardown(Snapshot, Source);
+    ResetEvent(m_TeardownIdle);
+
+    StartTeardown();
+    SetEvent(m_TeardownQueued);
+}
+// waits only while a snapshot of, or taken of, one of the VDIs is queued
+void
+XenVssProvider::WaitTeardown(
+    const GUID_VCT&             Vdis
+    )
+{
+    HANDLE  Handles[2] = { m_Cancel, m_TeardownIdle };
+
+    for (;;) {
+        bool    Pending(false);
+        {
+            AutoLock    Lock(m_TeardownLock);
+
+            for (GUID_VCT::const_iterator Vdi = Vdis.begin(); Vdi != Vdis.end() && !Pending; ++Vdi) {
+                if (IsEqualGUID(*Vdi, GUID_NULL))
+                    continue;
+                for (GUID_GUID_MAP::iterator it = m_TeardownVdis.begin(); it != m_TeardownVdis.end(); ++it) {
+                    if (IsEqualGUID(it->first, *Vdi) || IsEqualGUID(it->second, *Vdi)) {
+                        Trace("VDI {%s} waits for teardown\n", Guid(*Vdi).c_str());
+                        Pending = true;
+                        break;
+                    }
+                }
+            }
+        }
+        if (!Pending)
+            return;
+
+        if (WaitForMultipleObjects(2, Handles, FALSE, INFINITE) == WAIT_OBJECT_0)
+            throw XENVSS_E_CANCELLED;
+    }
+}
+// deports and destroys everything queued, in one request per batch; a batch
+// dom0 fails stays in the registry and is retried, as a batch of its own,
+// by the next drain
+void
+XenVssProvider::DrainTeardown(
+    )
+{
+    XenIfaceItf&    Store(*m_Store);
+    VSS_ID          Owner(__RequestId());
+    GUID_GUID_MAP   Retry;
+    {
+        AutoLock    Lock(m_TeardownLock);
+
+        // what is in the registry but not queued was failed by an earlier drain
+        __LoadTeardown(Retry);
+        for (GUID_GUID_MAP::iterator it = m_TeardownVdis.begin(); it != m_TeardownVdis.end(); ++it)
+            Retry.erase(it->first);
+    }
+
+    for (;;) {
+        GUID_GUID_MAP   Batch;
+        HRESULT         hr(S_OK);
+        {
+            AutoLock    Lock(m_TeardownLock);
+
+            if (m_TeardownVdis.empty()) {
+                if (Retry.empty()) {
+                    SetEvent(m_TeardownIdle);
+                    return;
+                }
+                Trace("Retrying teardown of %d snapshots\n", (ULONG)Retry.size());
+                m_TeardownVdis.swap(Retry);
+            }
+            Batch = m_TeardownVdis;
+        }
+
+        // the provider may be unloaded meanwhile
+        if (!m_Dom0->Acquire(Owner, m_Cancel))
+            return;
+
+        // a snapshot that is not deported cannot be destroyed
+        try {
+            XenIfaceBatch Request;
+            Request.Remove(m_Vm + "/snapshot");
+            for (GUID_GUID_MAP::iterator it = Batch.begin(); it != Batch.end(); ++it)
+                Request.Write(m_Vm + "/snapshot/" + Guid(it->first), "");
+
+            __SetWait(Store, m_Vm, DeportSnapshot, m_Cancel, &Request);
+            __SetWait(Store, m_Vm, DestroySnapshot, m_Cancel);
+        } catch (HRESULT _hr) {
+            hr = _hr;
+            Trace("Exception %s:%08x\n", __HR(hr), hr);
+        } catch (...) {
+            hr = E_UNEXPECTED;
+            Trace("Exception E_UNEXPECTED\n");
+        }
+        (VOID)Store.TryRemove(m_Vm + "/snapshot");
+        (VOID)Store.TryRemove(m_Vm + "/snapinfo");
+        (VOID)Store.TryRemove(m_Vm + "/snapuuid");
+        m_Dom0->Release(Owner);
+
+        // left in the registry for the next instance to finish
+        if (WaitForSingleObject(m_Cancel, 0) == WAIT_OBJECT_0)
+            return;
+
+        // no longer waited for, but a failed teardown stays in the registry
+        AutoLock    Lock(m_TeardownLock);
+        for (GUID_GUID_MAP::iterator it = Batch.begin(); it != Batch.end(); ++it) {
+            m_TeardownVdis.erase(it->first);
+            if (FAILED(hr))
+                Trace("Teardown of {%s} failed, left for the next drain\n", Guid(it->first).c_str());
+            else
+                __ForgetTeardown(it->first);
+        }
+    }
+}
+DWORD WINAPI
+XenVssProvider::TeardownThread(
+    PVOID                       Argument
+    )
+{
+    XenVssProvider* Provider = (XenVssProvider*)Argument;
+    HANDLE          Handles[2] = { Provider->m_Cancel, Provider->m_TeardownQueued };
+
+    while (WaitForMultipleObjects(2, Handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+        Provider->DrainTeardown();
+    return 0;
+}
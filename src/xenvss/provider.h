@@ -35,9 +35,12 @@
 #include <includes.h>
 #include "Resource.h"
 #include "xenvss_i.h"
+#include "bytes.h"
+#include "vpd.h"
 
 #include <map>
 #include <string>
+#include <vector>
 using namespace std;
 
 inline bool operator<(const GUID& a, const GUID& b)
@@ -45,6 +48,47 @@ inline bool operator<(const GUID& a, const GUID& b)
     return memcmp(&a, &b, sizeof(GUID)) < 0;
 }
 typedef map<GUID, GUID>     GUID_GUID_MAP;
+typedef vector<GUID>        GUID_VCT;
+typedef vector<BOOL>        BOOL_VCT;
+
+typedef map<string, GUID>   TARGET_VDI_MAP;
+typedef map<string, GUID>   LUN_VDI_MAP;
+
+typedef struct _SNAPSHOT_PAGES {
+    Bytes                   Page80;         // serial number
+    string                  Page83;         // identification descriptors, base64
+    PAGE83_INDEX            Page83Index;    // first descriptor of each kind
+} SNAPSHOT_PAGES;
+typedef map<GUID, SNAPSHOT_PAGES> SNAPSHOT_PAGES_MAP;
+
+class XenIfaceItf;
+class StoreWatch;
+class ResolverPool;
+class Dom0Token;
+class XenVssProvider;
+
+// one snapshot set, from BeginPrepareSnapshot until PostFinalCommitSnapshots
+// or AbortSnapshots
+typedef struct _SNAPSHOT_SET {
+    XenVssProvider*         Provider;
+    VSS_ID                  SetId;
+    CRITICAL_SECTION        Lock;           // held for a whole callback of the set, dom0 waits included
+    LONG                    References;     // under m_CritSec, one for m_Sets and one per EnterSet
+    bool                    Deleted;        // under m_CritSec, removed from m_Sets
+    VSS_SNAPSHOT_STATE      State;
+    ULONG                   Context;
+    GUID_GUID_MAP           Snapshots;      // VDI => snapshot VDI
+    LUN_VDI_MAP             LunVdis;        // device-id descriptor => VDI, set by BeginPrepareSnapshot
+    HANDLE                  Cancel;         // set by AbortSnapshots to end dom0 waits
+    bool                    Dom0;           // holds dom0 from EndPrepareSnapshots to PostCommitSnapshots
+    ULONGLONG               StateStart;     // StatsNow() at the last change of State
+    ULONGLONG               FreezeStart;    // StatsNow() at PreCommitSnapshots
+    HANDLE                  Prefetch;       // started by PostCommitSnapshots
+    HRESULT                 PrefetchResult;
+    string                  SnapInfo;       // set by Prefetch
+    SNAPSHOT_PAGES_MAP      Pages;          // snapshot VDI => pages, set by Prefetch
+} SNAPSHOT_SET, *PSNAPSHOT_SET;
+typedef map<VSS_ID, PSNAPSHOT_SET> SNAPSHOT_SET_MAP;
 
 class ATL_NO_VTABLE XenVssProvider :
         public CComObjectRootEx< CComSingleThreadModel >,
@@ -148,21 +192,138 @@ public:
             __in BOOL Force);
 
 private:
+    // held briefly, never across a store round trip; guards m_Sets and the
+    // State, Snapshots and LunVdis of each set, which other sets look at
     CRITICAL_SECTION        m_CritSec;
-
-    VSS_SNAPSHOT_STATE      m_State;
-    VSS_ID                  m_SetId;
-    ULONG                   m_Context;
+    SNAPSHOT_SET_MAP        m_Sets;
     string                  m_Vm;
-    GUID_GUID_MAP           m_Snapshots;
     bool                    m_InVm;
     bool                    m_UseSrcSerialNumber;
-    bool                    m_IsVssSupported;
+    volatile bool           m_IsVssSupported;
+    XenIfaceItf*            m_Store;
+    HANDLE                  m_Cancel;       // set on unload to end dom0 waits
+
+    // owned by a set id, or by a request id for a single callback; with a
+    // set's Lock held, acquire only as that set, as no holder of dom0 waits
+    // for another set's Lock
+    Dom0Token*              m_Dom0;
+
+    CRITICAL_SECTION        m_TargetLock;
+    TARGET_VDI_MAP          m_TargetVdis;   // target id => VDI, under m_TargetLock
+    StoreWatch*             m_TargetWatch;  // data/scsi/target
+
+    CRITICAL_SECTION        m_PolicyLock;
+    StoreWatch*             m_PolicyWatch;  // vm-data/allowvssprovider
+    ULONGLONG               m_PolicyRead;   // StatsNow() when m_IsVssSupported was read, 0 if stale
+
+    // helpers for the LUNs ResolveLuns cannot answer from m_TargetVdis
+    ResolverPool*           m_Resolvers;
+
+    // snapshots are deported and destroyed by a worker, the queue is kept in
+    // the registry until dom0 has answered
+    CRITICAL_SECTION        m_TeardownLock;
+    GUID_GUID_MAP           m_TeardownVdis;     // snapshot VDI => VDI it was taken of, under m_TeardownLock
+    HANDLE                  m_TeardownQueued;   // auto-reset, set when m_TeardownVdis grows
+    HANDLE                  m_TeardownIdle;     // signalled while m_TeardownVdis is empty
+    HANDLE                  m_TeardownThread;
     
 private:
+    // lock order is dom0, then a set's Lock, then m_CritSec
+    PSNAPSHOT_SET EnterSet(
+            const VSS_ID&               SetId,
+            bool                        Create);
+    void LeaveSet(
+            PSNAPSHOT_SET               Set);
+    void DereferenceSet(
+            PSNAPSHOT_SET               Set);
+    void CancelSet(
+            const VSS_ID&               SetId);
+
+    // callers hold m_CritSec
+    PSNAPSHOT_SET FindSet(
+            const VSS_ID&               SetId);
+    PSNAPSHOT_SET FindSetByLuns(
+            LONG                        Count,
+            VDS_LUN_INFORMATION*        Luns);
+    PSNAPSHOT_SET CreateSet(
+            const VSS_ID&               SetId);
+
+    // callers hold the set's Lock
+    void DeleteSet(
+            PSNAPSHOT_SET               Set);
+    void AbortSet(
+            SNAPSHOT_SET&               Set);
+    // records the snapshot dom0 reports for each VDI still without one,
+    // Required throws if an id is missing
+    void ReadSnapshotIds(
+            SNAPSHOT_SET&               Set,
+            bool                        Required);
+    void SetState(
+            SNAPSHOT_SET&               Set,
+            VSS_SNAPSHOT_STATE          State);
+
+    void QueueTeardown(
+            const GUID&                 Snapshot,
+            const GUID&                 Source);
+    // the worker needs dom0, which may be waiting for a set's Lock, so
+    // callers hold neither
+    void WaitTeardown(
+            const GUID_VCT&             Vdis);
+    void StartTeardown();
+    void DrainTeardown();
+    static DWORD WINAPI TeardownThread(
+            PVOID                       Context);
+
     bool IsRunningOnVM();
     bool IsVSSSupported();
+    bool GetVdi(
+            XenIfaceItf&                Store,
+            const VDS_LUN_INFORMATION&  Lun,
+            GUID*                       Vdi);
+    GUID ResolveTarget(
+            XenIfaceItf&                Store,
+            const string&               TargetId);
+    // false if the cache cannot answer without reading the store
+    bool CachedTarget(
+            const string&               TargetId,
+            GUID*                       Vdi);
+    bool GetCachedVdi(
+            const VDS_LUN_INFORMATION&  Lun,
+            GUID*                       Vdi,
+            BOOL*                       Found);
+
+    // resolves the VDI of each LUN, fanning the store reads out over a few threads
+    enum { MaxResolveThreads = 7 };
+    void ResolveLuns(
+            LONG                        Count,
+            VDS_LUN_INFORMATION*        Luns,
+            GUID_VCT&                   Vdis,
+            BOOL_VCT&                   Found);
+    static void ResolveLun(
+            XenIfaceItf&                Store,
+            LONG                        Next,
+            PVOID                       Context);
+    // as ResolveLuns, but LUNs prepared in the set are found in its LunVdis
+    void LookupLuns(
+            SNAPSHOT_SET&               Set,
+            LONG                        Count,
+            VDS_LUN_INFORMATION*        Luns,
+            GUID_VCT&                   Vdis,
+            BOOL_VCT&                   Found);
+
+    // collects snapinfo and the decoded inquiry pages of every snapshot,
+    // on a worker between PostCommitSnapshots and GetTargetLuns
+    void Prefetch(
+            SNAPSHOT_SET&               Set,
+            bool                        CreateInfo);
+    void StartPrefetch(
+            SNAPSHOT_SET&               Set);
+    HRESULT JoinPrefetch(
+            SNAPSHOT_SET&               Set);
+    static DWORD WINAPI PrefetchThread(
+            PVOID                       Context);
     bool CloneLunInfo(
+            const SNAPSHOT_SET&         Set,
             VDS_LUN_INFORMATION&        Dst, 
             const VDS_LUN_INFORMATION&  Src,
             const string&               SnapInfo, // XML
@@ -0,0 +1,157 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENVSS_RESOLVERS_H_
+#define _XENVSS_RESOLVERS_H_
+
+#include <windows.h>
+#include <xeniface_interface.h>
+#include "debug.h"
+
+#include <vector>
+using namespace std;
+
+// looks up one item of a batch, Index counting from 0
+typedef void (*RESOLVE_FN)(XenIfaceItf& Store, LONG Index, PVOID Context);
+
+//=============================================================================
+// helper threads that share out a batch of store lookups with the caller,
+// started on first use and kept until the pool is deleted; one batch at a
+// time. each helper keeps its own handle, so its reads are not queued
+// behind the others
+class ResolverPool
+{
+public:
+    // cancel ends the helpers, its owner sets it before deleting the pool
+    ResolverPool(HANDLE cancel, LONG threads) :
+            m_cancel(cancel), m_threads(threads), m_batch(NULL)
+    {
+        InitializeCriticalSection(&m_lock);
+        m_start = CreateSemaphore(NULL, 0, threads, NULL);
+        m_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    }
+    ~ResolverPool()
+    {
+        for (size_t i = 0; i < m_handles.size(); ++i) {
+            WaitForSingleObject(m_handles[i], INFINITE);
+            CloseHandle(m_handles[i]);
+        }
+        CloseHandle(m_done);
+        CloseHandle(m_start);
+        DeleteCriticalSection(&m_lock);
+    }
+
+    // calls fn for each index below count, on this thread through store and
+    // on as many helpers as there are other indexes; returns the helpers used
+    LONG Run(XenIfaceItf& store, LONG count, RESOLVE_FN fn, PVOID context)
+    {
+        BATCH   batch = { count, fn, context, 0, 0 };
+        LONG    helpers(0);
+
+        if (count <= 1) {
+            Next(store, batch);
+            return 0;
+        }
+
+        EnterCriticalSection(&m_lock);
+
+        // this thread takes a share too, so only wake helpers for the rest
+        Start();
+        helpers = min(count - 1, (LONG)m_handles.size());
+        batch.Helpers = helpers;
+        m_batch = &batch;
+        if (helpers)
+            ReleaseSemaphore(m_start, helpers, NULL);
+
+        Next(store, batch);
+
+        if (helpers)
+            WaitForSingleObject(m_done, INFINITE);
+        m_batch = NULL;
+
+        LeaveCriticalSection(&m_lock);
+        return helpers;
+    }
+
+private:
+    typedef struct _BATCH {
+        LONG            Count;
+        RESOLVE_FN      Fn;
+        PVOID           Context;
+        volatile LONG   Next;
+        volatile LONG   Helpers;    // woken and not yet done
+    } BATCH, *PBATCH;
+
+    // under m_lock
+    void Start()
+    {
+        while (m_handles.size() < (size_t)m_threads) {
+            HANDLE thread = CreateThread(NULL, 0, Helper, this, 0, NULL);
+            if (thread == NULL) {
+                Trace("CreateThread failed (%d), %d helper threads\n", GetLastError(), (LONG)m_handles.size());
+                break;
+            }
+            m_handles.push_back(thread);
+        }
+    }
+    static void Next(XenIfaceItf& store, BATCH& batch)
+    {
+        LONG    next;
+
+        while ((next = InterlockedIncrement(&batch.Next) - 1) < batch.Count)
+            batch.Fn(store, next, batch.Context);
+    }
+    static DWORD WINAPI Helper(PVOID argument)
+    {
+        ResolverPool*   pool = (ResolverPool*)argument;
+        HANDLE          handles[2] = { pool->m_cancel, pool->m_start };
+
+        XenIfaceItf store;
+        while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+            PBATCH  batch = (PBATCH)pool->m_batch;
+
+            Next(store, *batch);
+            if (InterlockedDecrement(&batch->Helpers) == 0)
+                SetEvent(pool->m_done);
+        }
+        return 0;
+    }
+
+    HANDLE              m_cancel;
+    LONG                m_threads;
+    CRITICAL_SECTION    m_lock;
+    vector<HANDLE>      m_handles;
+    HANDLE              m_start;    // semaphore, released once for each helper a batch wakes
+    HANDLE              m_done;     // auto-reset, set by the last helper of a batch
+    PVOID volatile      m_batch;    // under m_lock
+};
+
+#endif // _XENVSS_RESOLVERS_H_
@@ -0,0 +1,214 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENVSS_SETWAIT_H_
+#define _XENVSS_SETWAIT_H_
+
+#include <windows.h>
+#include <winioctl.h>
+#include <xeniface_interface.h>
+#include "debug.h"
+#include "stats.h"
+
+#include <string>
+using namespace std;
+
+typedef struct _SETWAIT_OP {
+    const char*     set;
+    const char*     pass;
+    const char*     fail;
+    DWORD           timeout;    // ms, overridden by a DWORD named after "set" in the XenVss key
+} SETWAIT_OP, *PSETWAIT_OP;
+
+// polling intervals when xeniface cannot watch the status key
+#define SETWAIT_POLL_MIN    4
+#define SETWAIT_POLL_MAX    1000
+
+#define XENVSS_E_TIMEOUT    HRESULT_FROM_WIN32(ERROR_TIMEOUT)
+#define XENVSS_E_CANCELLED  HRESULT_FROM_WIN32(ERROR_CANCELLED)
+
+//=============================================================================
+class StoreWatch
+{
+public:
+    StoreWatch(XenIfaceItf& itf, const string& path) :
+            m_itf(itf), m_path(path), m_event(NULL), m_context(NULL), m_generation(0)
+    {
+        m_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (m_event == NULL)
+            return;
+
+        Register();
+    }
+    ~StoreWatch()
+    {
+        // a watch on a handle that has since been replaced went with it
+        if (m_context && m_generation == m_itf.Generation()) {
+            try {
+                m_itf.Unwatch(m_context);
+            } catch (...) {
+            }
+        }
+        if (m_event)
+            CloseHandle(m_event);
+    }
+
+    // returns early when the watched key changes, false if cancel was signalled
+    bool Wait(DWORD timeout, HANDLE cancel)
+    {
+        HANDLE  handles[2] = { cancel, m_event };
+
+        if (Renewed())
+            return WaitForSingleObject(cancel, 0) != WAIT_OBJECT_0;
+        if (m_context)
+            return WaitForMultipleObjects(2, handles, FALSE, timeout) != WAIT_OBJECT_0;
+        else
+            return WaitForSingleObject(cancel, timeout) != WAIT_OBJECT_0;
+    }
+    bool Active() const
+    {
+        return m_context != NULL && m_generation == m_itf.Generation();
+    }
+    // true once for every batch of changes since the last call, and after a
+    // reconnect, when changes may have been missed
+    bool Fired()
+    {
+        if (Renewed())
+            return true;
+        return m_context != NULL && WaitForSingleObject(m_event, 0) == WAIT_OBJECT_0;
+    }
+private:
+    // older xeniface versions cannot watch, fall back to polling
+    void Register()
+    {
+        m_generation = m_itf.Generation();
+        try {
+            m_context = m_itf.Watch(m_path, m_event);
+        } catch (HRESULT hr) {
+            Trace("Watch \"%s\" failed %s:%08x, polling\n", m_path.c_str(), __HR(hr), hr);
+            m_context = NULL;
+        }
+    }
+    // re-registers a watch lost to a reconnect, true if it did
+    bool Renewed()
+    {
+        if (m_event == NULL || m_generation == m_itf.Generation())
+            return false;
+
+        Trace("Watch \"%s\" lost on reconnect\n", m_path.c_str());
+        m_context = NULL;
+        Register();
+        return true;
+    }
+
+    XenIfaceItf&    m_itf;
+    string          m_path;
+    HANDLE          m_event;
+    PVOID           m_context;
+    ULONG           m_generation;   // of the connection m_context belongs to
+};
+//=============================================================================
+static __inline void
+__SetWait(
+    XenIfaceItf&        itf,
+    const string&       path,
+    const SETWAIT_OP&   op,
+    HANDLE              cancel,
+    XenIfaceBatch*      request = NULL
+    )
+{
+    ULONGLONG   start = StatsNow();
+    DWORD       interval;
+    DWORD       backoff = SETWAIT_POLL_MIN;
+
+    // watch before writing, so dom0's response cannot be missed
+    StoreWatch  Watch(itf, path + "/status");
+
+    // when polling, sleep through most of a typical request before backing
+    // off geometrically from a few ms
+    if (Watch.Active())
+        interval = SETWAIT_POLL_MAX;
+    else
+        interval = min(max((StatsAverageOp(op.set) * 3) / 4, (ULONG)SETWAIT_POLL_MIN),
+                       (ULONG)SETWAIT_POLL_MAX);
+
+    // the status key goes last, dom0 only reads the request keys once it changes
+    if (request) {
+        request->Write(path + "/status", op.set);
+        itf.Flush(*request);
+    } else {
+        itf.Write(path + "/status", op.set);
+    }
+
+    for (;;) {
+        string value = itf.Read(path + "/status");
+
+        if (value == op.pass) {
+            StatsRecordOp(op.set, StatsElapsed(start), false);
+            (VOID)itf.TryRemove(path + "/status");
+            return;
+        }
+        if (value == op.fail) {
+            StatsRecordOp(op.set, StatsElapsed(start), false);
+            (VOID)itf.TryRemove(path + "/status");
+            throw E_FAIL;
+        }
+
+        // check for invalid value
+        if (value != op.set) {
+            Trace("\"%s\" != \"%s\"|\"%s\" for \"%s\"\n", value.c_str(), op.pass, op.fail, op.set);
+            throw E_INVALIDARG; // eek - unknown value
+        }
+
+        ULONG elapsed = StatsElapsed(start);
+        // withdraw the request, so dom0 does not start on it late; one
+        // already under way may still leave results under path
+        if (elapsed >= op.timeout) {
+            Trace("\"%s\" timed out after %d ms\n", op.set, elapsed);
+            StatsRecordOp(op.set, elapsed, true);
+            (VOID)itf.TryRemove(path + "/status");
+            throw XENVSS_E_TIMEOUT;
+        }
+
+        // wait for the status key to change, re-read at least once a sec
+        if (!Watch.Wait(min(op.timeout - elapsed, interval), cancel)) {
+            Trace("\"%s\" cancelled after %d ms\n", op.set, StatsElapsed(start));
+            (VOID)itf.TryRemove(path + "/status");
+            throw XENVSS_E_CANCELLED;
+        }
+        if (!Watch.Active()) {
+            interval = backoff;
+            backoff = min(backoff * 2, (DWORD)SETWAIT_POLL_MAX);
+        }
+    }
+}
+
+#endif // _XENVSS_SETWAIT_H_
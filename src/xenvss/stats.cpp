@@ -0,0 +1,251 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <windows.h>
+#include <vsprov.h>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <stdio.h>
+
+#include "stats.h"
+#include "debug.h"
+
+static SRWLOCK      StatsLock = SRWLOCK_INIT;
+static Histogram    StatsStates[VSS_SS_COUNT];  // time spent in each state
+static Histogram    StatsFreeze;                // PreCommitSnapshots -> PostCommitSnapshots
+static bool         StatsToFile = false;
+
+typedef struct _OP_STATS {
+    Histogram   Latency;                        // completed by dom0, pass or fail
+    ULONG       Average;                        // moving average of Latency
+    ULONG       Timeouts;
+} OP_STATS;
+
+typedef vector<string>          StringVct;
+typedef map<string, OP_STATS>   OP_STATS_MAP;
+
+static OP_STATS_MAP StatsOps;                   // keyed by SETWAIT_OP.set
+
+static void WriteStatsFile(const string& str)
+{
+    FILE*   fp;
+
+    if (fopen_s(&fp, "C:\\Program Files\\Citrix\\XenTools\\xenvss-stats.log", "wt") == 0) {
+        fprintf(fp, "%s", str.c_str());
+        fflush(fp);
+        fclose(fp);
+    }
+}
+
+Histogram::Histogram() :
+        m_Count(0), m_Total(0), m_Min(0), m_Max(0)
+{
+    memset(m_Buckets, 0, sizeof(m_Buckets));
+}
+void Histogram::Add(ULONG Milliseconds)
+{
+    ULONG   Bucket = 0;
+
+    while (Bucket < BUCKETS - 1 && Milliseconds >= (1UL << Bucket))
+        ++Bucket;
+
+    ++m_Buckets[Bucket];
+    if (m_Count == 0 || Milliseconds < m_Min)
+        m_Min = Milliseconds;
+    if (Milliseconds > m_Max)
+        m_Max = Milliseconds;
+    m_Total += Milliseconds;
+    ++m_Count;
+}
+ULONG Histogram::Count() const
+{
+    return m_Count;
+}
+string Histogram::ToString() const
+{
+    char    tmp[64];
+    string  retval;
+
+    _snprintf_s(tmp, sizeof(tmp), _TRUNCATE, "n=%lu min=%lu avg=%lu max=%lu ms |",
+                m_Count, m_Min, m_Count ? (ULONG)(m_Total / m_Count) : 0, m_Max);
+    retval = tmp;
+    for (ULONG i = 0; i < BUCKETS; ++i) {
+        _snprintf_s(tmp, sizeof(tmp), _TRUNCATE, " %lu", m_Buckets[i]);
+        retval += tmp;
+    }
+    return retval;
+}
+
+ULONGLONG
+StatsNow(
+    )
+{
+    static LARGE_INTEGER    Frequency = { 0 };
+    LARGE_INTEGER           Counter;
+
+    if (Frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Counter);
+
+    // microseconds
+    return (ULONGLONG)((Counter.QuadPart / Frequency.QuadPart) * 1000000 +
+                       ((Counter.QuadPart % Frequency.QuadPart) * 1000000) / Frequency.QuadPart);
+}
+ULONG
+StatsElapsed(
+    ULONGLONG           Since
+    )
+{
+    return (ULONG)((StatsNow() - Since) / 1000);
+}
+void
+StatsRecordState(
+    VSS_SNAPSHOT_STATE  State,
+    ULONG               Milliseconds
+    )
+{
+    if (State < 0 || State >= VSS_SS_COUNT)
+        return;
+
+    AcquireSRWLockExclusive(&StatsLock);
+    StatsStates[State].Add(Milliseconds);
+    ReleaseSRWLockExclusive(&StatsLock);
+}
+void
+StatsRecordFreeze(
+    ULONG               Milliseconds
+    )
+{
+    Trace("Freeze %lu ms\n", Milliseconds);
+
+    AcquireSRWLockExclusive(&StatsLock);
+    StatsFreeze.Add(Milliseconds);
+    ReleaseSRWLockExclusive(&StatsLock);
+}
+void
+StatsRecordOp(
+    const char*         Op,
+    ULONG               Milliseconds,
+    bool                TimedOut
+    )
+{
+    AcquireSRWLockExclusive(&StatsLock);
+    OP_STATS_MAP::iterator it = StatsOps.find(Op);
+    if (it == StatsOps.end()) {
+        OP_STATS Stats;
+        Stats.Average = 0;
+        Stats.Timeouts = 0;
+        it = StatsOps.insert(OP_STATS_MAP::value_type(Op, Stats)).first;
+    }
+    if (TimedOut) {
+        ++it->second.Timeouts;
+    } else {
+        it->second.Latency.Add(Milliseconds);
+        if (it->second.Latency.Count() == 1)
+            it->second.Average = Milliseconds;
+        else
+            it->second.Average = (it->second.Average * 3 + Milliseconds) / 4;
+    }
+    ReleaseSRWLockExclusive(&StatsLock);
+}
+ULONG
+StatsAverageOp(
+    const char*         Op
+    )
+{
+    ULONG   Average = 0;
+
+    AcquireSRWLockShared(&StatsLock);
+    OP_STATS_MAP::const_iterator it = StatsOps.find(Op);
+    if (it != StatsOps.end())
+        Average = it->second.Average;
+    ReleaseSRWLockShared(&StatsLock);
+
+    return Average;
+}
+void
+StatsDump(
+    )
+{
+    StringVct   Lines;
+    string      Dump;
+
+    AcquireSRWLockShared(&StatsLock);
+    Lines.push_back("FREEZE " + StatsFreeze.ToString());
+    for (ULONG State = 0; State < VSS_SS_COUNT; ++State) {
+        if (StatsStates[State].Count() == 0)
+            continue;
+        Lines.push_back(string(__VssState((VSS_SNAPSHOT_STATE)State)) + " " + StatsStates[State].ToString());
+    }
+    for (OP_STATS_MAP::iterator it = StatsOps.begin(); it != StatsOps.end(); ++it) {
+        char    Timeouts[32];
+        _snprintf_s(Timeouts, sizeof(Timeouts), _TRUNCATE, " timeouts=%lu", it->second.Timeouts);
+        Lines.push_back(it->first + " " + it->second.Latency.ToString() + Timeouts);
+    }
+    ReleaseSRWLockShared(&StatsLock);
+
+    for (StringVct::iterator it = Lines.begin(); it != Lines.end(); ++it) {
+        Trace("%s\n", it->c_str());
+        Dump += *it + "\n";
+    }
+    if (StatsToFile)
+        WriteStatsFile(Dump);
+}
+void
+StatsInitialize(
+    )
+{
+    HKEY    hKey;
+    LONG    lResult;
+
+    StatsToFile = false;
+
+    lResult = RegOpenKeyExA(HKEY_LOCAL_MACHINE, "SOFTWARE\\Citrix\\XenTools\\XenVss", 0, KEY_READ, &hKey);
+    if (lResult == ERROR_SUCCESS) {
+        DWORD   Type;
+        DWORD   Data = 0;
+        DWORD   DataSize = sizeof(DWORD);
+
+        lResult = RegGetValueA(hKey, NULL, "StatsToFile", 0, &Type, &Data, &DataSize);
+        if (lResult == ERROR_SUCCESS) {
+            if (Type == REG_DWORD && DataSize == sizeof(DWORD)) {
+                if (Data) {
+                    StatsToFile = true;
+                }
+            }
+        }
+
+        RegCloseKey(hKey);
+    }
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENVSS_STATS_H_
+#define _XENVSS_STATS_H_
+
+#include <includes.h>
+#include <string>
+using namespace std;
+
+// latencies in milliseconds, bucketed by powers of 2
+class Histogram
+{
+public:
+    Histogram();
+
+    void Add(ULONG Milliseconds);
+    ULONG Count() const;
+    string ToString() const;
+
+private:
+    enum { BUCKETS = 16 };  // <1ms, <2ms, <4ms ... >=16s
+
+    ULONG       m_Buckets[BUCKETS];
+    ULONG       m_Count;
+    ULONGLONG   m_Total;
+    ULONG       m_Min;
+    ULONG       m_Max;
+};
+
+extern ULONGLONG
+StatsNow(
+    );
+extern ULONG
+StatsElapsed(
+    ULONGLONG           Since
+    );
+
+extern void
+StatsRecordState(
+    VSS_SNAPSHOT_STATE  State,
+    ULONG               Milliseconds
+    );
+extern void
+StatsRecordFreeze(
+    ULONG               Milliseconds
+    );
+extern void
+StatsRecordOp(
+    const char*         Op,
+    ULONG               Milliseconds,
+    bool                TimedOut
+    );
+extern ULONG
+StatsAverageOp(
+    const char*         Op
+    );
+extern void
+StatsDump(
+    );
+extern void
+StatsInitialize(
+    );
+
+#endif // _XENVSS_STATS_H_
@@ -0,0 +1,182 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENVSS_VPD_H_
+#define _XENVSS_VPD_H_
+
+#include <windows.h>
+#include <vdslun.h>
+#include "bytes.h"
+
+#include <map>
+#include <cctype>
+#include <utility>
+using namespace std;
+
+#pragma pack(push, 1)
+typedef struct _VPD_IDENTIFICATION_DESCRIPTOR {
+    UCHAR   CodeSet     : 4;
+    UCHAR   Reserved    : 4;
+    UCHAR   Type        : 4;
+    UCHAR   Association : 2;
+    UCHAR   Reserved2   : 2;
+    UCHAR   Reserved3;
+    UCHAR   Length;
+    UCHAR   Identifier[1];
+} VPD_IDENTIFICATION_DESCRIPTOR, *PVPD_IDENTIFICATION_DESCRIPTOR;
+#pragma pack(pop)
+
+// device type, page code and page length precede the body of a VPD page
+#define VPD_HEADER_LENGTH   4
+
+// an identifier within page 0x83, as an offset so the page can be moved
+typedef struct _PAGE83_IDENTIFIER {
+    size_t                  Offset;
+    size_t                  Length;
+} PAGE83_IDENTIFIER;
+typedef map<ULONG, PAGE83_IDENTIFIER> PAGE83_INDEX;   // by code set, type and association
+
+// the page length in bytes 2 and 3 of the header counts the bytes after it
+static __inline size_t
+__VpdPageLength(
+    const unsigned char*        Header
+    )
+{
+    return ((size_t)Header[2] << 8) | Header[3];
+}
+// page 0x80 is the ASCII serial number, space padded, after the page header;
+// false if the page is shorter than its header says
+static __inline bool
+__VpdSerialNumber(
+    const BytesView&            Page80,
+    BytesView*                  SerialNumber
+    )
+{
+    BytesView   Header;
+    BytesView   Body;
+    size_t      Length;
+
+    if (!Page80.Sub(0, VPD_HEADER_LENGTH, &Header))
+        return false;
+    if (!Page80.Sub(VPD_HEADER_LENGTH, __VpdPageLength(Header.Ptr()), &Body))
+        return false;
+
+    for (Length = Body.Length(); Length != 0; --Length) {
+        if (!std::isspace(Body.Ptr()[Length - 1]))
+            break;
+    }
+    return Body.Sub(0, Length, SerialNumber);
+}
+static __inline ULONG
+__Page83Key(
+    ULONG                       CodeSet,
+    ULONG                       Type,
+    ULONG                       Association
+    )
+{
+    return (Association << 8) | (Type << 4) | CodeSet;
+}
+// page 0x83 is a list of identification descriptors after the page header;
+// only the headers are decoded, keeping the first descriptor of each kind as
+// a scan of the page would find it. A page shorter than its header says, or
+// with a descriptor that runs past the end of the page, is left unindexed
+static __inline bool
+__IndexPage83(
+    const Base64View&           Page83,
+    PAGE83_INDEX&               Index
+    )
+{
+    const size_t                    HeaderLength = FIELD_OFFSET(VPD_IDENTIFICATION_DESCRIPTOR, Identifier);
+    unsigned char                   PageHeader[VPD_HEADER_LENGTH];
+    VPD_IDENTIFICATION_DESCRIPTOR   Header;
+    size_t                          Offset = VPD_HEADER_LENGTH;
+    size_t                          End;
+
+    Index.clear();
+    if (!Page83.Decode(0, VPD_HEADER_LENGTH, PageHeader))
+        return false;
+    End = VPD_HEADER_LENGTH + __VpdPageLength(PageHeader);
+    if (End > Page83.Length())
+        return false;
+
+    while (Offset != End) {
+        PAGE83_IDENTIFIER   Id;
+
+        if (HeaderLength > End - Offset ||
+            !Page83.Decode(Offset, HeaderLength, (unsigned char*)&Header))
+            break;
+
+        Id.Offset = Offset + HeaderLength;
+        Id.Length = Header.Length;
+        if (Id.Length > End - Id.Offset)
+            break;
+
+        Index.insert(std::make_pair(__Page83Key(Header.CodeSet, Header.Type, Header.Association), Id));
+        Offset = Id.Offset + Id.Length;
+    }
+    if (Offset != End) {
+        Index.clear();
+        return false;
+    }
+    return true;
+}
+// the identifier is decoded straight into the buffer VSS is handed, sized to
+// the identifier and allocated with CoTaskMemAlloc for VSS to free
+static __inline bool
+__CloneFromPage83(
+    VDS_STORAGE_IDENTIFIER&     DstId,
+    const PAGE83_INDEX&         Index,
+    const Base64View&           Page83
+    )
+{
+    // descriptor code sets and types are 4 bits wide
+    if ((ULONG)DstId.m_CodeSet > 0xf || (ULONG)DstId.m_Type > 0xf)
+        return false;
+
+    PAGE83_INDEX::const_iterator it = Index.find(__Page83Key(DstId.m_CodeSet, DstId.m_Type, 0));
+    if (it == Index.end())
+        return false;
+
+    BYTE* Identifier = (BYTE*)::CoTaskMemAlloc(it->second.Length);
+    if (Identifier == NULL)
+        throw E_OUTOFMEMORY;
+
+    if (!Page83.Decode(it->second.Offset, it->second.Length, Identifier)) {
+        ::CoTaskMemFree(Identifier);
+        return false;
+    }
+
+    DstId.m_cbIdentifier    = (ULONG)it->second.Length;
+    DstId.m_rgbIdentifier   = Identifier;
+    return true;
+}
+
+#endif // _XENVSS_VPD_H_
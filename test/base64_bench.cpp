@@ -0,0 +1,214 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// Bytes' base64 codec against the one it replaced, copied below from the
+// original bytes.cpp: a branchy character mapping, a zeroed buffer per
+// decode and an output string grown four characters at a time, across
+// payload sizes from a short page 0x80 to well past a page 0x83
+//
+// usage: base64_bench [MB of base64 per measurement, default 32]
+
+#include <windows.h>
+#include <stats.h>
+#include "bytes.h"
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+//=============================================================================
+// the original codec
+
+static __inline char NumToAscii(unsigned char num)
+{
+    if (num < 26)
+        return 'A' + num;
+    if (num < 52)
+        return 'a' + num - 26;
+    if (num < 62)
+        return '0' + num - 52;
+    if (num == 62)
+        return '+';
+    if (num == 63)
+        return '/';
+    return '=';
+}
+static __inline unsigned char AsciiToBase64(char ch)
+{
+    if (ch >= 'A' && ch <= 'Z')
+        return ch - 'A';
+    if (ch >= 'a' && ch <= 'z')
+        return ch - 'a' + 26;
+    if (ch >= '0' && ch <= '9')
+        return ch - '0' + 52;
+    if (ch == '+')
+        return 62;
+    if (ch == '/')
+        return 63;
+    return 64;
+}
+
+// Bytes::FromBase64, with Resize's zeroed allocation and Clear's delete
+static size_t OldFromBase64(const string& base64, unsigned char** bytes)
+{
+    size_t  length = 0;
+
+    if (base64.length() % 4)
+        throw "InvalidInputLength";
+    *bytes = new unsigned char[(base64.length() / 4) * 3];
+    memset(*bytes, 0, (base64.length() / 4) * 3);
+    for (size_t i = 0; i < base64.length(); i += 4) {
+        unsigned char val[4] =
+        {
+            AsciiToBase64(base64[i]),
+            AsciiToBase64(base64[i + 1]),
+            AsciiToBase64(base64[i + 2]),
+            AsciiToBase64(base64[i + 3])
+        };
+        (*bytes)[length++] = (val[0] << 2) | (val[1] >> 4);
+        if (val[2] == 64) break;
+        (*bytes)[length++] = (val[1] << 4) | (val[2] >> 2);
+        if (val[3] == 64) break;
+        (*bytes)[length++] = (val[2] << 6) | val[3];
+    }
+    return length;
+}
+static string OldToBase64(const unsigned char* bytes, size_t length)
+{
+    string retval;
+    for (size_t i = 0; i < length; i+= 3) {
+        unsigned char in[3] = { 0, 0, 0 };
+        int len = 0;
+        for (size_t j = 0; j < 3; ++j) {
+            if (i + j < length) {
+                in[j] = bytes[i + j];
+                ++len;
+            }
+        }
+        char out[5] = { '=', '=', '=', '=', 0 };
+        out[0] = NumToAscii( in[0] >> 2 );
+        out[1] = NumToAscii( ((in[0] & 0x03) << 4) | ((in[1] & 0xf0) >> 4) );
+        out[2] = len > 1 ? NumToAscii( ((in[1] & 0x0f) << 2) | ((in[2] & 0xc0) >> 6) ) : '=';
+        out[3] = len > 2 ? NumToAscii( (in[2] & 0x3f) ) : '=';
+        retval += out;
+    }
+    return retval;
+}
+
+//=============================================================================
+
+// keeps the optimizer from dropping a result
+static volatile size_t Sink;
+
+static Bytes Payload(size_t length)
+{
+    Bytes       bytes(length + 1);   // Length() must stay below the capacity
+    ULONG       seed = (ULONG)length * 2654435761u;
+
+    bytes.Length(length);
+    for (size_t i = 0; i < length; ++i) {
+        seed = seed * 1103515245 + 12345;
+        bytes[i] = (unsigned char)(seed >> 16);
+    }
+    return bytes;
+}
+
+// ns per call of run, over enough calls to cover total bytes of base64
+template <class Fn>
+static double Time(size_t chars, size_t total, Fn run)
+{
+    size_t  calls = max(total / chars, (size_t)1);
+
+    run();
+    ULONGLONG start = StatsNow();
+    for (size_t call = 0; call < calls; ++call)
+        run();
+    return (StatsNow() - start) * 1000.0 / calls;
+}
+
+int main(int argc, char** argv)
+{
+    static const size_t Sizes[] = { 16, 36, 64, 256, 1024, 4096, 65536 };
+    size_t  total = (argc > 1 ? atoi(argv[1]) : 32) << 20;
+    int     failures = 0;
+
+    printf("%7s %9s %9s %9s %9s %7s %9s %9s %7s\n", "bytes",
+           "old dec", "new dec", "strict", "view", "speedup",
+           "old enc", "new enc", "speedup");
+    printf("%7s %9s %9s %9s %9s %7s %9s %9s %7s\n", "",
+           "ns", "ns", "ns", "ns", "", "ns", "ns", "");
+    for (size_t i = 0; i < sizeof(Sizes) / sizeof(Sizes[0]); ++i) {
+        Bytes           payload = Payload(Sizes[i]);
+        const string    base64 = payload.ToBase64();
+        unsigned char*  old;
+
+        // both codecs agree before either is timed
+        size_t length = OldFromBase64(base64, &old);
+        if (length != payload.Length() || memcmp(old, payload.Ptr(0), length) != 0)
+            ++failures;
+        delete [] old;
+        if (OldToBase64(payload.Ptr(0), payload.Length()) != base64)
+            ++failures;
+
+        double oldDecode = Time(base64.length(), total, [&] {
+            unsigned char* bytes;
+            Sink = OldFromBase64(base64, &bytes);
+            delete [] bytes;
+        });
+        double newDecode = Time(base64.length(), total, [&] {
+            Bytes bytes;
+            Sink = bytes.FromBase64(base64).Length();
+        });
+        double strictDecode = Time(base64.length(), total, [&] {
+            Bytes bytes;
+            Sink = bytes.FromBase64(base64, true).Length();
+        });
+        vector<unsigned char> buffer(payload.Length());
+        double viewDecode = Time(base64.length(), total, [&] {
+            Base64View view(base64);
+            Sink = view.Decode(0, view.Length(), &buffer[0]);
+        });
+        double oldEncode = Time(base64.length(), total, [&] {
+            Sink = OldToBase64(payload.Ptr(0), payload.Length()).length();
+        });
+        double newEncode = Time(base64.length(), total, [&] {
+            Sink = payload.ToBase64().length();
+        });
+
+        printf("%7u %9.0f %9.0f %9.0f %9.0f %6.1fx %9.0f %9.0f %6.1fx\n", (ULONG)Sizes[i],
+               oldDecode, newDecode, strictDecode, viewDecode, oldDecode / newDecode,
+               oldEncode, newEncode, oldEncode / newEncode);
+    }
+    if (failures)
+        printf("base64_bench: the codecs disagree on %d payloads\n", failures);
+    return failures;
+}
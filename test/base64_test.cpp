@@ -0,0 +1,178 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// round trips and malformed input for Bytes::FromBase64 and ToBase64, in
+// both the lenient and the strict mode
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string>
+#include "bytes.h"
+#include "test.h"
+
+static Bytes
+Decode(
+    const string&   base64,
+    bool            strict
+    )
+{
+    Bytes   bytes;
+    bytes.FromBase64(base64, strict);
+    return bytes;
+}
+
+static bool
+Equals(
+    const Bytes&    bytes,
+    const char*     chars
+    )
+{
+    return bytes == Bytes((const unsigned char*)chars, strlen(chars));
+}
+
+// RFC 4648 section 10, every tail length and padding
+static void
+TestVectors()
+{
+    static const char* Vectors[][2] = {
+        { "",       ""          },
+        { "f",      "Zg=="      },
+        { "fo",     "Zm8="      },
+        { "foo",    "Zm9v"      },
+        { "foob",   "Zm9vYg=="  },
+        { "fooba",  "Zm9vYmE="  },
+        { "foobar", "Zm9vYmFy"  },
+    };
+
+    for (size_t i = 0; i < sizeof(Vectors) / sizeof(Vectors[0]); ++i) {
+        Bytes   bytes((const unsigned char*)Vectors[i][0], strlen(Vectors[i][0]));
+
+        CHECK(bytes.ToBase64() == Vectors[i][1]);
+        CHECK(Equals(Decode(Vectors[i][1], false), Vectors[i][0]));
+        CHECK(Equals(Decode(Vectors[i][1], true), Vectors[i][0]));
+    }
+}
+
+// every length up to a few times the 8 character body step, so each tail
+// length meets each alignment of the fast path
+static void
+TestRoundTrip()
+{
+    srand(1);
+    for (size_t length = 0; length < 100; ++length) {
+        for (int pass = 0; pass < 20; ++pass) {
+            Bytes   bytes;
+            for (size_t i = 0; i < length; ++i)
+                bytes += (unsigned char)rand();
+
+            string  base64 = bytes.ToBase64();
+            CHECK(base64.length() == ((length + 2) / 3) * 4);
+            CHECK(Decode(base64, false) == bytes);
+            CHECK(Decode(base64, true) == bytes);
+            CHECK(Bytes(base64) == bytes);
+        }
+    }
+}
+
+static void
+TestLength()
+{
+    CHECK_THROWS(Decode("Zm9", false), "InvalidInputLength");
+    CHECK_THROWS(Decode("Zm9", true), "InvalidInputLength");
+    CHECK_THROWS(Decode("Zm9vY", false), "InvalidInputLength");
+    CHECK_THROWS(Decode("Zm9vY", true), "InvalidInputLength");
+}
+
+// lenient decoding keeps what precedes the first character outside the
+// alphabet and drops the rest of the input, strict decoding throws
+static void
+TestInvalidCharacter()
+{
+    CHECK(Equals(Decode("Zm9v!mFy", false), "foo"));
+    CHECK(Equals(Decode("Zm9vY!Fy", false), "foo"));
+    CHECK(Equals(Decode("Zm9vYm!y", false), "foob"));
+    CHECK(Equals(Decode("Zm9vYmF!", false), "fooba"));
+
+    CHECK_THROWS(Decode("Zm9v!mFy", true), "InvalidCharacter");
+    CHECK_THROWS(Decode("Zm9vY!Fy", true), "InvalidCharacter");
+    CHECK_THROWS(Decode("Zm9vYm!y", true), "InvalidCharacter");
+    CHECK_THROWS(Decode("Zm9vYmF!", true), "InvalidCharacter");
+    CHECK_THROWS(Decode("Zm9v\nmFy", true), "InvalidCharacter");
+
+    // in the 8 character body and in the last quad of a longer input
+    string  base64 = Bytes((const unsigned char*)"0123456789abcdefghijklmn", 24).ToBase64();
+    for (size_t i = 0; i < base64.length(); ++i) {
+        string  bad(base64);
+        bad[i] = '*';
+
+        Bytes   bytes = Decode(bad, false);
+        CHECK(bytes.Length() == (i / 4) * 3 + (i % 4 < 2 ? 0 : i % 4 - 1));
+        CHECK(memcmp((const unsigned char*)bytes, "0123456789abcdefghijklmn", bytes.Length()) == 0);
+        CHECK_THROWS(Decode(bad, true), "InvalidCharacter");
+    }
+}
+
+// padding only belongs at the end of the last quad
+static void
+TestPadding()
+{
+    CHECK(Equals(Decode("Zg==Zm8=", false), "f"));
+    CHECK(Equals(Decode("Zm8=Zm9v", false), "fo"));
+    CHECK(Equals(Decode("Zg=A", false), "f"));
+    CHECK(Equals(Decode("=m9v", false), ""));
+    CHECK(Equals(Decode("Z=9v", false), ""));
+
+    CHECK_THROWS(Decode("Zg==Zm8=", true), "InvalidPadding");
+    CHECK_THROWS(Decode("Zm8=Zm9v", true), "InvalidPadding");
+    CHECK_THROWS(Decode("Zg=A", true), "InvalidPadding");
+    CHECK_THROWS(Decode("=m9v", true), "InvalidPadding");
+    CHECK_THROWS(Decode("Z=9v", true), "InvalidPadding");
+    CHECK_THROWS(Decode("Z===", true), "InvalidPadding");
+    CHECK_THROWS(Decode("====", true), "InvalidPadding");
+    CHECK_THROWS(Decode("Zm9vYmFyZm9vYmFy====", true), "InvalidPadding");
+
+    // set bits under the padding
+    CHECK(Equals(Decode("Zh==", false), "f"));
+    CHECK(Equals(Decode("Zm9=", false), "fo"));
+    CHECK_THROWS(Decode("Zh==", true), "NonCanonicalPadding");
+    CHECK_THROWS(Decode("Zm9=", true), "NonCanonicalPadding");
+}
+
+int
+main()
+{
+    TestVectors();
+    TestRoundTrip();
+    TestLength();
+    TestInvalidCharacter();
+    TestPadding();
+    return TestResult("base64_test");
+}
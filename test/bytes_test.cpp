@@ -0,0 +1,227 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// heap allocations made by Bytes: inline storage, geometric growth and moves
+
+#include <windows.h>
+#include <stdlib.h>
+#include <new>
+#include <string>
+#include <utility>
+#include "bytes.h"
+#include "test.h"
+
+// every allocation in the program goes through these
+static size_t   __News = 0;
+static size_t   __Deletes = 0;
+
+void* operator new(size_t size)
+{
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    ++__News;
+    return ptr;
+}
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+void operator delete(void* ptr) throw()
+{
+    if (ptr == NULL)
+        return;
+    ++__Deletes;
+    free(ptr);
+}
+void operator delete[](void* ptr) throw()
+{
+    operator delete(ptr);
+}
+void operator delete(void* ptr, size_t) throw()
+{
+    operator delete(ptr);
+}
+void operator delete[](void* ptr, size_t) throw()
+{
+    operator delete(ptr);
+}
+
+static unsigned char    Data[8192];
+
+// up to InlineCapacity - 1 bytes, one is kept spare for a terminator, fit
+// without touching the heap
+static void
+TestInline()
+{
+    size_t  news = __News;
+    size_t  deletes = __Deletes;
+    {
+        Bytes   bytes;
+        for (size_t i = 0; i < Bytes::InlineCapacity - 1; ++i)
+            bytes += Data[i];
+        CHECK(bytes.Length() == Bytes::InlineCapacity - 1);
+        CHECK(bytes.Capacity() == Bytes::InlineCapacity);
+        CHECK(__News == news);
+
+        // the next byte moves the payload to the heap, once
+        bytes += Data[Bytes::InlineCapacity - 1];
+        CHECK(__News == news + 1);
+        CHECK(bytes.Length() == Bytes::InlineCapacity);
+        CHECK(bytes.Capacity() == Bytes::InlineCapacity * 2);
+        CHECK(memcmp((const unsigned char*)bytes, Data, bytes.Length()) == 0);
+    }
+    CHECK(__Deletes == deletes + 1);
+    news = __News;
+
+    Bytes   small(Data, Bytes::InlineCapacity - 1);
+    CHECK(__News == news);
+    Bytes   large(Data, Bytes::InlineCapacity);
+    CHECK(__News == news + 1);
+    CHECK(small.Length() == Bytes::InlineCapacity - 1);
+    CHECK(large.Length() == Bytes::InlineCapacity);
+}
+
+// a decoded VPD page, up to 252 bytes of identifiers, stays inline
+static void
+TestDecodedPage()
+{
+    string  base64 = Bytes(Data, 252).ToBase64();
+    size_t  news = __News;
+    {
+        Bytes   page;
+        page.FromBase64(base64);
+        CHECK(page.Length() == 252);
+        CHECK(memcmp((const unsigned char*)page, Data, 252) == 0);
+    }
+    CHECK(__News == news);
+}
+
+// appending a byte at a time doubles the capacity, so N bytes take about
+// log2(N / InlineCapacity) allocations
+static void
+TestGrowth()
+{
+    size_t  news = __News;
+    size_t  deletes = __Deletes;
+    size_t  capacity = Bytes::InlineCapacity;
+    size_t  grown = 0;
+    {
+        Bytes   bytes;
+        for (size_t i = 0; i < sizeof(Data); ++i) {
+            bytes += Data[i];
+            if (bytes.Capacity() != capacity) {
+                CHECK(bytes.Capacity() == capacity * 2);
+                capacity = bytes.Capacity();
+                ++grown;
+            }
+        }
+        CHECK(memcmp((const unsigned char*)bytes, Data, sizeof(Data)) == 0);
+    }
+    // 256 -> 512 -> ... -> 16384
+    CHECK(grown == 6);
+    CHECK(__News - news == grown);
+    CHECK(__Deletes - deletes == grown);
+
+    // a request larger than double is met exactly
+    news = __News;
+    Bytes   bytes(Bytes::InlineCapacity * 5);
+    CHECK(bytes.Capacity() == Bytes::InlineCapacity * 5);
+    CHECK(__News == news + 1);
+}
+
+// moves steal a heap buffer and copy an inline one, neither allocates, and
+// leave the source empty and usable
+static void
+TestMove()
+{
+    Bytes           heap(Data, 1000);
+    const void*     buffer = (const unsigned char*)heap;
+    size_t          news = __News;
+
+    Bytes           moved(std::move(heap));
+    CHECK(__News == news);
+    CHECK((const unsigned char*)moved == buffer);
+    CHECK(moved.Length() == 1000);
+    CHECK(heap.Length() == 0);
+    CHECK(heap.Capacity() == Bytes::InlineCapacity);
+
+    heap += Data[0];
+    CHECK(heap.Length() == 1 && heap[0] == Data[0]);
+    CHECK(__News == news);
+
+    Bytes           inline_(Data, 100);
+    Bytes           copied(std::move(inline_));
+    CHECK(__News == news);
+    CHECK(copied.Length() == 100);
+    CHECK(memcmp((const unsigned char*)copied, Data, 100) == 0);
+    CHECK(inline_.Length() == 0);
+
+    // move assignment frees the target's heap buffer and takes the source's
+    Bytes           target(Data, 2000);
+    size_t          deletes = __Deletes;
+    news = __News;
+    buffer = (const unsigned char*)moved;
+    target = std::move(moved);
+    CHECK(__News == news);
+    CHECK(__Deletes == deletes + 1);
+    CHECK((const unsigned char*)target == buffer);
+    CHECK(target.Length() == 1000);
+    CHECK(moved.Length() == 0);
+
+    target = std::move(target);
+    CHECK(target.Length() == 1000);
+
+    // a copy of a heap payload allocates once
+    news = __News;
+    Bytes           copy(target);
+    CHECK(__News == news + 1);
+    CHECK(copy == target);
+
+    // operator+ builds its result once, and it is moved out
+    news = __News;
+    Bytes           sum = copy + target;
+    CHECK(__News == news + 1);
+    CHECK(sum.Length() == 2000);
+}
+
+int
+main()
+{
+    for (size_t i = 0; i < sizeof(Data); ++i)
+        Data[i] = (unsigned char)rand();
+
+    TestInline();
+    TestDecodedPage();
+    TestGrowth();
+    TestMove();
+    return TestResult("bytes_test");
+}
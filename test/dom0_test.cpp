@@ -0,0 +1,279 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// two snapshot sets' callbacks interleaved, with the dom0 traffic
+// XenVssProvider makes for each: a set holds dom0 from EndPrepareSnapshots
+// until PostCommitSnapshots has read its ids, so another set's request
+// cannot replace /snapshot in between. dom0 is a thread answering requests
+
+#include "test.h"
+#include <windows.h>
+// the stand-ins first, their guards keep out the ATL debug.h and stats.h
+// the provider headers would otherwise find beside them
+#include <debug.h>
+#include <stats.h>
+#include "setwait.h"
+#include "dom0.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+
+static const SETWAIT_OP Create = { "create-snapshot", "snapshot-created", "snapshot-error", 10000 };
+static const string     Vm = "vss/test";
+static const string     Status = Vm + "/status";
+
+typedef struct _SET {
+    GUID                SetId;
+    StringVct           Vdis;
+    HANDLE              Cancel;
+    map<string, string> Ids;
+} SET;
+
+static void InitSet(SET& set, ULONG id, const char* vdi1, const char* vdi2)
+{
+    set.SetId = GUID_NULL;
+    set.SetId.Data1 = id;
+    set.Vdis.push_back(vdi1);
+    set.Vdis.push_back(vdi2);
+    set.Cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+// answers "create-snapshot" with an id for each staged VDI, and records
+// the VDIs each request named
+class Dom0
+{
+public:
+    Dom0() : m_stop(false), m_thread(&Dom0::Run, this)
+    {}
+    ~Dom0()
+    {
+        m_stop = true;
+        m_thread.join();
+    }
+    vector<StringVct> Requests()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_requests;
+    }
+
+private:
+    void Run()
+    {
+        XenIfaceItf store;
+
+        while (!m_stop) {
+            if (!XenIfaceItf::WaitFor(Status, Create.set, 20))
+                continue;
+
+            StringVct   vdis;
+            (VOID)store.TryDirectory(Vm + "/snapshot", &vdis);
+            for (size_t i = 0; i < vdis.size(); ++i)
+                store.Write(Vm + "/snapshot/" + vdis[i] + "/id", "snap-" + vdis[i]);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_requests.push_back(vdis);
+            }
+            store.Write(Status, Create.pass);
+        }
+    }
+
+    std::atomic<bool>   m_stop;
+    std::mutex          m_mutex;
+    vector<StringVct>   m_requests;
+    std::thread         m_thread;
+};
+
+// EndPrepareSnapshots stages the request and keeps dom0 for the set
+static void EndPrepare(XenIfaceItf& store, Dom0Token& dom0, SET& set)
+{
+    XenIfaceBatch   request;
+
+    dom0.Acquire(set.SetId);
+    request.Remove(Vm + "/snapshot");
+    for (size_t i = 0; i < set.Vdis.size(); ++i)
+        request.Write(Vm + "/snapshot/" + set.Vdis[i], "");
+    store.Flush(request);
+    CHECK(store.Directory(Vm + "/snapshot").size() == set.Vdis.size());
+    dom0.Acquire(set.SetId);
+    dom0.Release(set.SetId);
+}
+// CommitSnapshots only flips the status key
+static void Commit(XenIfaceItf& store, Dom0Token& dom0, SET& set)
+{
+    dom0.Acquire(set.SetId);
+    __SetWait(store, Vm, Create, set.Cancel);
+    dom0.Release(set.SetId);
+}
+// PostCommitSnapshots reads the ids and gives up the set's hold
+static void PostCommit(XenIfaceItf& store, Dom0Token& dom0, SET& set)
+{
+    dom0.Acquire(set.SetId);
+    for (size_t i = 0; i < set.Vdis.size(); ++i) {
+        string  id;
+        if (SUCCEEDED(store.TryRead(Vm + "/snapshot/" + set.Vdis[i] + "/id", &id)))
+            set.Ids[set.Vdis[i]] = id;
+    }
+    (VOID)store.TryRemove(Vm + "/snapshot");
+    dom0.Release(set.SetId);
+    dom0.Release(set.SetId);
+}
+
+static void CheckIds(const SET& set)
+{
+    CHECK(set.Ids.size() == set.Vdis.size());
+    for (size_t i = 0; i < set.Vdis.size(); ++i) {
+        map<string, string>::const_iterator it = set.Ids.find(set.Vdis[i]);
+        CHECK(it != set.Ids.end() && it->second == "snap-" + set.Vdis[i]);
+    }
+}
+
+// B prepares while A is between EndPrepare and Commit: B waits for A's
+// PostCommit, and each "create-snapshot" names only its own set's VDIs
+static void TestInterleaved()
+{
+    XenIfaceItf         store;
+    Dom0Token           token;
+    SET                 a;
+    SET                 b;
+    HANDLE              prepared = CreateEvent(NULL, TRUE, FALSE, NULL);
+    HANDLE              commit = CreateEvent(NULL, TRUE, FALSE, NULL);
+    std::atomic<bool>   bPrepared(false);
+
+    XenIfaceItf::Reset();
+    store.Write(Status, "provider-initialized");
+    InitSet(a, 1, "vdi-a1", "vdi-a2");
+    InitSet(b, 2, "vdi-b1", "vdi-b2");
+    {
+        Dom0    dom0;
+
+        std::thread setA([&] {
+            XenIfaceItf store;
+            EndPrepare(store, token, a);
+            SetEvent(prepared);
+            WaitForSingleObject(commit, INFINITE);
+            Commit(store, token, a);
+            PostCommit(store, token, a);
+        });
+        std::thread setB([&] {
+            XenIfaceItf store;
+            WaitForSingleObject(prepared, INFINITE);
+            EndPrepare(store, token, b);
+            bPrepared = true;
+            Commit(store, token, b);
+            PostCommit(store, token, b);
+        });
+
+        WaitForSingleObject(prepared, INFINITE);
+        Sleep(50);
+        CHECK(!bPrepared);
+        CHECK(!token.TryAcquire(b.SetId));
+        SetEvent(commit);
+
+        setA.join();
+        setB.join();
+
+        vector<StringVct> requests = dom0.Requests();
+        CHECK(requests.size() == 2);
+        if (requests.size() == 2) {
+            CHECK(requests[0] == a.Vdis);
+            CHECK(requests[1] == b.Vdis);
+        }
+    }
+    CheckIds(a);
+    CheckIds(b);
+    CHECK(token.TryAcquire(b.SetId));
+    token.Release(b.SetId);
+
+    CloseHandle(commit);
+    CloseHandle(prepared);
+    CloseHandle(a.Cancel);
+    CloseHandle(b.Cancel);
+}
+
+// AbortSnapshots on B while it waits for dom0 held by A, as GetTargetLuns'
+// inline prefetch does; A keeps dom0
+static void TestCancelWaiting()
+{
+    Dom0Token           token;
+    SET                 a;
+    SET                 b;
+    std::atomic<bool>   acquired(true);
+
+    InitSet(a, 1, "vdi-a1", "vdi-a2");
+    InitSet(b, 2, "vdi-b1", "vdi-b2");
+    token.Acquire(a.SetId);
+
+    std::thread setB([&] {
+        acquired = token.Acquire(b.SetId, b.Cancel);
+    });
+    Sleep(20);
+    SetEvent(b.Cancel);
+    setB.join();
+
+    CHECK(!acquired);
+    CHECK(!token.TryAcquire(b.SetId));
+    token.Release(a.SetId);
+    CHECK(token.TryAcquire(b.SetId));
+    token.Release(b.SetId);
+
+    CloseHandle(a.Cancel);
+    CloseHandle(b.Cancel);
+}
+
+// the owner nests, anyone else's release is ignored
+static void TestNesting()
+{
+    Dom0Token   token;
+    GUID        a = GUID_NULL;
+    GUID        b = GUID_NULL;
+
+    a.Data1 = 1;
+    b.Data1 = 2;
+    token.Acquire(a);
+    CHECK(token.TryAcquire(a));
+    token.Release(b);
+    CHECK(!token.TryAcquire(b));
+    token.Release(a);
+    CHECK(!token.TryAcquire(b));
+    token.Release(a);
+    CHECK(token.TryAcquire(b));
+    token.Release(b);
+}
+
+int main()
+{
+    TestInterleaved();
+    TestCancelWaiting();
+    TestNesting();
+    return TestResult("dom0_test");
+}
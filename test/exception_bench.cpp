@@ -0,0 +1,262 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// store exceptions per snapshot set: one set's store traffic, as the
+// provider makes it, replayed against the in-memory store with the cleanups
+// and expected-missing reads done through the throwing API, as before the
+// Try* variants, and through the Try* variants, as now. dom0's side answers
+// each request at once, so the timings are the guest's own cost. like
+// xenstored, the store lets a missing key be removed when its parent exists
+//
+// usage: exception_bench [LUNs, default 4]
+
+#include <windows.h>
+#include <debug.h>
+#include <stats.h>
+#include <xeniface_interface.h>
+
+#include <stdlib.h>
+#include <string>
+using namespace std;
+
+static const string Vm = "vss/bench";
+static LONG         Luns;
+static bool         Throwing;   // the style being replayed
+
+static string Vdi(LONG index)
+{
+    char    vdi[64];
+
+    snprintf(vdi, sizeof(vdi), "00000000-0000-0000-0000-%012d", index);
+    return vdi;
+}
+static string Snap(LONG index)
+{
+    char    snap[64];
+
+    snprintf(snap, sizeof(snap), "11111111-0000-0000-0000-%012d", index);
+    return snap;
+}
+
+// TRY(Store.Remove(path)) before, (VOID)Store.TryRemove(path) now
+static void Cleanup(XenIfaceItf& store, const string& path)
+{
+    if (Throwing) {
+        try {
+            store.Remove(path);
+        } catch (HRESULT) {
+        }
+    } else {
+        (VOID)store.TryRemove(path);
+    }
+}
+// a key that may be absent, read in a try block before
+static bool Lookup(XenIfaceItf& store, const string& path, string* value)
+{
+    if (!Throwing)
+        return SUCCEEDED(store.TryRead(path, value));
+
+    try {
+        *value = store.Read(path);
+        return true;
+    } catch (HRESULT) {
+        return false;
+    }
+}
+
+static void CreateSnapshots(XenIfaceItf& dom0)
+{
+    for (LONG index = 0; index < Luns; ++index)
+        dom0.Write(Vm + "/snapshot/" + Vdi(index) + "/id", Snap(index));
+}
+static void CreateSnapshotInfo(XenIfaceItf& dom0)
+{
+    dom0.Write(Vm + "/snapinfo", "snapinfo");
+    for (LONG index = 0; index < Luns; ++index) {
+        string scsi = Vm + "/snapshot/" + Snap(index) + "/scsi/0x12/";
+        dom0.Write(scsi + "0x80", "AIAAAA==");
+        dom0.Write(scsi + "0x83", "AIMAAA==");
+    }
+}
+
+// as __SetWait, with dom0 answering before the first read; without dom0
+// the request times out and is withdrawn
+static void Request(XenIfaceItf& store, XenIfaceBatch& request, const char* set,
+                    const char* pass, void (*dom0)(XenIfaceItf&))
+{
+    request.Write(Vm + "/status", set);
+    store.Flush(request);
+    if (dom0) {
+        dom0(store);
+        store.Write(Vm + "/status", pass);
+    }
+    string status = store.Read(Vm + "/status");
+    Cleanup(store, Vm + "/status");
+}
+// a request naming a VDI, or a snapshot, for each LUN
+static void Stage(XenIfaceBatch& request, string (*name)(LONG))
+{
+    request.Remove(Vm + "/snapshot");
+    for (LONG index = 0; index < Luns; ++index)
+        request.Write(Vm + "/snapshot/" + name(index), "");
+}
+
+// IsLunSupported, the policy is read once per set, and EndPrepareSnapshots
+static void Prepare(XenIfaceItf& store)
+{
+    XenIfaceBatch   request;
+    string          policy;
+
+    (VOID)Lookup(store, "vm-data/allowvssprovider", &policy);
+    Stage(request, Vdi);
+    store.Flush(request);
+    store.Directory(Vm + "/snapshot");
+}
+// CommitSnapshots and PostCommitSnapshots
+static void Commit(XenIfaceItf& store)
+{
+    XenIfaceBatch   request;
+    string          id;
+
+    Request(store, request, "create-snapshot", "snapshot-created", CreateSnapshots);
+    for (LONG index = 0; index < Luns; ++index)
+        (VOID)Lookup(store, Vm + "/snapshot/" + Vdi(index) + "/id", &id);
+    Cleanup(store, Vm + "/snapshot");
+}
+// the prefetch worker and PostFinalCommitSnapshots
+static void Prefetch(XenIfaceItf& store)
+{
+    XenIfaceBatch   request;
+
+    Stage(request, Snap);
+    Request(store, request, "create-snapshotinfo", "snapshotinfo-created", CreateSnapshotInfo);
+    store.Read(Vm + "/snapinfo");
+    for (LONG index = 0; index < Luns; ++index) {
+        string scsi = Vm + "/snapshot/" + Snap(index) + "/scsi/0x12/";
+        store.Read(scsi + "0x80");
+        store.Read(scsi + "0x83");
+    }
+    Cleanup(store, Vm + "/snapshot");
+}
+// DrainTeardown
+static void Teardown(XenIfaceItf& store)
+{
+    XenIfaceBatch   request;
+
+    Stage(request, Snap);
+    Request(store, request, "deport-snapshot", "snapshot-deported", NULL);
+    Request(store, request, "destroy-snapshot", "snapshot-destroyed", NULL);
+    Cleanup(store, Vm + "/snapshot");
+    Cleanup(store, Vm + "/snapinfo");
+    Cleanup(store, Vm + "/snapuuid");
+}
+// "create-snapshot" timed out, AbortSet looks for ids dom0 may have left
+static void Abort(XenIfaceItf& store)
+{
+    XenIfaceBatch   request;
+    string          id;
+
+    Request(store, request, "create-snapshot", "snapshot-created", NULL);
+    for (LONG index = 0; index < Luns; ++index)
+        (VOID)Lookup(store, Vm + "/snapshot/" + Vdi(index) + "/id", &id);
+    Cleanup(store, Vm + "/snapshot");
+    Cleanup(store, Vm + "/snapinfo");
+    Cleanup(store, Vm + "/snapuuid");
+}
+
+// the constructor, once per load
+static void Load(XenIfaceItf& store)
+{
+    Cleanup(store, Vm + "/snapshot");
+    Cleanup(store, Vm + "/snapinfo");
+    Cleanup(store, Vm + "/snapuuid");
+    store.Write(Vm + "/status", "provider-initialized");
+}
+static void Backup(XenIfaceItf& store)
+{
+    Prepare(store);
+    Commit(store);
+    Prefetch(store);
+    Teardown(store);
+}
+static void Aborted(XenIfaceItf& store)
+{
+    Prepare(store);
+    Abort(store);
+}
+
+typedef struct _SCENARIO {
+    const char*     Name;
+    void            (*Run)(XenIfaceItf&);
+} SCENARIO;
+
+static const SCENARIO Scenarios[] = {
+    { "load",       Load },
+    { "backup",     Backup },
+    { "abort",      Aborted },
+};
+
+// exceptions per run and us per run, from a store holding only m_Vm
+static void Measure(const SCENARIO& scenario, double* throws, double* us)
+{
+    const int   runs = 2000;
+    XenIfaceItf store;
+
+    XenIfaceItf::Reset();
+    store.Write(Vm + "/status", "provider-initialized");
+
+    ULONGLONG start = StatsNow();
+    for (int run = 0; run < runs; ++run)
+        scenario.Run(store);
+    *us = (double)(StatsNow() - start) / runs;
+    *throws = (double)XenIfaceItf::Throws() / runs;
+}
+
+int main(int argc, char** argv)
+{
+    Luns = argc > 1 ? atoi(argv[1]) : 4;
+
+    printf("%d LUNs\n", Luns);
+    printf("%-8s %-7s %10s %10s\n", "", "API", "throws/run", "us/run");
+    for (size_t i = 0; i < sizeof(Scenarios) / sizeof(Scenarios[0]); ++i) {
+        for (int style = 0; style < 2; ++style) {
+            double  throws;
+            double  us;
+
+            Throwing = style == 0;
+            Measure(Scenarios[i], &throws, &us);
+            printf("%-8s %-7s %10.1f %10.1f\n", Scenarios[i].Name,
+                   Throwing ? "before" : "Try*", throws, us);
+        }
+    }
+    XenIfaceItf::Reset();
+    return 0;
+}
@@ -0,0 +1,74 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// host stand-in for stats.h: the clock the real one uses, and the last
+// latency recorded for each op rather than a running average
+
+#ifndef _XENVSS_STATS_H_
+#define _XENVSS_STATS_H_
+
+#include <windows.h>
+#include <map>
+#include <string>
+
+// microseconds since an arbitrary start
+inline ULONGLONG StatsNow()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULONGLONG)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// ms since start, a value from StatsNow
+inline ULONG StatsElapsed(ULONGLONG start)
+{
+    return (ULONG)((StatsNow() - start) / 1000);
+}
+
+inline std::map<std::string, ULONG>& __StatsOps()
+{
+    static std::map<std::string, ULONG> ops;
+    return ops;
+}
+
+inline void StatsRecordOp(const char* op, ULONG ms, bool timedout)
+{
+    if (!timedout)
+        __StatsOps()[op] = ms;
+}
+
+inline ULONG StatsAverageOp(const char* op)
+{
+    return __StatsOps()[op];
+}
+
+#endif // _XENVSS_STATS_H_
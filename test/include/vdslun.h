@@ -0,0 +1,65 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// host stand-in for the storage identifier definitions the VPD parsing uses
+
+#ifndef _TEST_VDSLUN_H_
+#define _TEST_VDSLUN_H_
+
+#include <windows.h>
+
+typedef enum _VDS_STORAGE_IDENTIFIER_CODE_SET {
+    VDSStorageIdCodeSetReserved = 0,
+    VDSStorageIdCodeSetBinary   = 1,
+    VDSStorageIdCodeSetAscii    = 2,
+    VDSStorageIdCodeSetUtf8     = 3
+} VDS_STORAGE_IDENTIFIER_CODE_SET;
+
+typedef enum _VDS_STORAGE_IDENTIFIER_TYPE {
+    VDSStorageIdTypeVendorSpecific              = 0,
+    VDSStorageIdTypeVendorId                    = 1,
+    VDSStorageIdTypeEUI64                       = 2,
+    VDSStorageIdTypeFCPHName                    = 3,
+    VDSStorageIdTypePortRelative                = 4,
+    VDSStorageIdTypeTargetPortGroup             = 5,
+    VDSStorageIdTypeLogicalUnitGroup            = 6,
+    VDSStorageIdTypeMD5LogicalUnitIdentifier    = 7,
+    VDSStorageIdTypeScsiNameString              = 8
+} VDS_STORAGE_IDENTIFIER_TYPE;
+
+typedef struct _VDS_STORAGE_IDENTIFIER {
+    VDS_STORAGE_IDENTIFIER_CODE_SET m_CodeSet;
+    VDS_STORAGE_IDENTIFIER_TYPE     m_Type;
+    ULONG                           m_cbIdentifier;
+    BYTE*                           m_rgbIdentifier;
+} VDS_STORAGE_IDENTIFIER;
+
+#endif // _TEST_VDSLUN_H_
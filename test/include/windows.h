@@ -0,0 +1,300 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// host stand-in for the few Windows definitions the portable sources use,
+// so they can be built and tested without the WDK
+
+#ifndef _TEST_WINDOWS_H_
+#define _TEST_WINDOWS_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+
+#define __inline    inline
+#define WINAPI
+
+typedef void                VOID;
+typedef void*               PVOID;
+typedef void*               HANDLE;
+typedef unsigned char       UCHAR;
+typedef unsigned char       BYTE;
+typedef unsigned char       BOOLEAN;
+typedef unsigned short      USHORT;
+typedef int                 BOOL;
+typedef unsigned int        ULONG;
+typedef unsigned int        DWORD;
+typedef int                 LONG;
+typedef unsigned long long  ULONGLONG;
+typedef LONG                HRESULT;
+
+#define TRUE    1
+#define FALSE   0
+
+using std::min;
+using std::max;
+
+typedef struct _GUID {
+    ULONG   Data1;
+    USHORT  Data2;
+    USHORT  Data3;
+    UCHAR   Data4[8];
+} GUID;
+
+const GUID  GUID_NULL = { 0, 0, 0, { 0 } };
+
+inline bool IsEqualGUID(const GUID& a, const GUID& b)
+{
+    return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+#define S_OK            ((HRESULT)0)
+#define S_FALSE         ((HRESULT)1)
+#define E_FAIL          ((HRESULT)0x80004005)
+#define E_INVALIDARG    ((HRESULT)0x80070057)
+#define E_UNEXPECTED    ((HRESULT)0x8000FFFF)
+#define E_OUTOFMEMORY   ((HRESULT)0x8007000E)
+
+#define SUCCEEDED(hr)   ((HRESULT)(hr) >= 0)
+#define FAILED(hr)      ((HRESULT)(hr) < 0)
+
+#define ERROR_FILE_NOT_FOUND    2
+#define ERROR_ACCESS_DENIED     5
+#define ERROR_NOT_SUPPORTED     50
+#define ERROR_CANCELLED         1223
+#define ERROR_TIMEOUT           1460
+
+#define HRESULT_FROM_WIN32(x)   ((HRESULT)(x) <= 0 ? (HRESULT)(x) : (HRESULT)(((x) & 0xffff) | 0x80070000))
+
+// events, semaphores and threads are signalled while Count is non-zero;
+// every wait is on one process-wide condition, which is plenty for tests
+#define INFINITE        0xffffffff
+#define WAIT_OBJECT_0   0
+#define WAIT_TIMEOUT    258
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(PVOID);
+
+typedef struct _HOST_OBJECT {
+    bool                    Manual;     // manual-reset event, or thread
+    bool                    Semaphore;
+    LONG                    Count;
+    LONG                    References;
+    LPTHREAD_START_ROUTINE  Routine;
+    PVOID                   Argument;
+} HOST_OBJECT, *PHOST_OBJECT;
+
+inline pthread_mutex_t* __HostLock()
+{
+    static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+    return &lock;
+}
+inline pthread_cond_t* __HostCond()
+{
+    static pthread_cond_t   cond = PTHREAD_COND_INITIALIZER;
+    return &cond;
+}
+inline PHOST_OBJECT __HostObject(bool manual, bool semaphore, LONG count, LONG references)
+{
+    PHOST_OBJECT object = new HOST_OBJECT();
+
+    object->Manual = manual;
+    object->Semaphore = semaphore;
+    object->Count = count;
+    object->References = references;
+    return object;
+}
+inline void __HostSignal(HANDLE handle, LONG count, bool add)
+{
+    PHOST_OBJECT object = (PHOST_OBJECT)handle;
+
+    pthread_mutex_lock(__HostLock());
+    object->Count = add ? object->Count + count : count;
+    pthread_cond_broadcast(__HostCond());
+    pthread_mutex_unlock(__HostLock());
+}
+inline bool __HostRelease(PHOST_OBJECT object)
+{
+    pthread_mutex_lock(__HostLock());
+    bool last = --object->References == 0;
+    pthread_mutex_unlock(__HostLock());
+    if (last)
+        delete object;
+    return last;
+}
+
+inline DWORD GetLastError()
+{
+    return errno;
+}
+inline HANDLE CreateEvent(PVOID, BOOL manual, BOOL initial, const char*)
+{
+    return __HostObject(manual != FALSE, false, initial ? 1 : 0, 1);
+}
+inline HANDLE CreateSemaphore(PVOID, LONG initial, LONG, const char*)
+{
+    return __HostObject(false, true, initial, 1);
+}
+inline BOOL SetEvent(HANDLE event)
+{
+    __HostSignal(event, 1, false);
+    return TRUE;
+}
+inline BOOL ResetEvent(HANDLE event)
+{
+    __HostSignal(event, 0, false);
+    return TRUE;
+}
+inline BOOL ReleaseSemaphore(HANDLE semaphore, LONG count, LONG*)
+{
+    __HostSignal(semaphore, count, true);
+    return TRUE;
+}
+inline void* __HostThread(void* argument)
+{
+    PHOST_OBJECT object = (PHOST_OBJECT)argument;
+
+    object->Routine(object->Argument);
+    __HostSignal(object, 1, false);
+    __HostRelease(object);
+    return NULL;
+}
+inline HANDLE CreateThread(PVOID, size_t, LPTHREAD_START_ROUTINE routine, PVOID argument, DWORD, DWORD*)
+{
+    PHOST_OBJECT object = __HostObject(true, false, 0, 2);
+    pthread_t    thread;
+
+    object->Routine = routine;
+    object->Argument = argument;
+    if (pthread_create(&thread, NULL, __HostThread, object) != 0) {
+        delete object;
+        return NULL;
+    }
+    pthread_detach(thread);
+    return object;
+}
+inline BOOL CloseHandle(HANDLE handle)
+{
+    __HostRelease((PHOST_OBJECT)handle);
+    return TRUE;
+}
+inline DWORD WaitForMultipleObjects(DWORD count, const HANDLE* handles, BOOL, DWORD timeout)
+{
+    struct timespec deadline;
+    DWORD           result = WAIT_TIMEOUT;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout != INFINITE) {
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(__HostLock());
+    for (;;) {
+        for (DWORD i = 0; i < count && result == WAIT_TIMEOUT; ++i) {
+            PHOST_OBJECT object = (PHOST_OBJECT)handles[i];
+            if (object->Count == 0)
+                continue;
+            if (object->Semaphore)
+                --object->Count;
+            else if (!object->Manual)
+                object->Count = 0;
+            result = WAIT_OBJECT_0 + i;
+        }
+        if (result != WAIT_TIMEOUT || timeout == 0)
+            break;
+        if (timeout == INFINITE)
+            pthread_cond_wait(__HostCond(), __HostLock());
+        else if (pthread_cond_timedwait(__HostCond(), __HostLock(), &deadline) == ETIMEDOUT)
+            timeout = 0;
+    }
+    pthread_mutex_unlock(__HostLock());
+    return result;
+}
+inline DWORD WaitForSingleObject(HANDLE handle, DWORD timeout)
+{
+    return WaitForMultipleObjects(1, &handle, FALSE, timeout);
+}
+inline VOID Sleep(DWORD milliseconds)
+{
+    usleep(milliseconds * 1000);
+}
+
+typedef pthread_mutex_t     CRITICAL_SECTION, *LPCRITICAL_SECTION;
+
+inline VOID InitializeCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(cs, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+inline VOID DeleteCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutex_destroy(cs);
+}
+inline VOID EnterCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutex_lock(cs);
+}
+inline VOID LeaveCriticalSection(LPCRITICAL_SECTION cs)
+{
+    pthread_mutex_unlock(cs);
+}
+
+inline LONG InterlockedIncrement(volatile LONG* value)
+{
+    return __sync_add_and_fetch(value, 1);
+}
+inline LONG InterlockedDecrement(volatile LONG* value)
+{
+    return __sync_sub_and_fetch(value, 1);
+}
+
+// defined by each test that uses them
+void* CoTaskMemAlloc(size_t size);
+void CoTaskMemFree(void* ptr);
+
+#define FIELD_OFFSET(type, field)   ((LONG)offsetof(type, field))
+
+#define _snprintf_s(buffer, size, count, ...)   snprintf(buffer, size, __VA_ARGS__)
+
+#endif // _TEST_WINDOWS_H_
@@ -0,0 +1,341 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// host stand-in for XenIfaceItf: one in-memory store shared by every
+// instance, with xenstore's watch semantics. each instance is a handle, so
+// its operations are serialized and each may be delayed to model the ring
+// round trip. tests drive dom0's side through the same interface
+
+#ifndef _XENSTORE_INTERFACE_H_
+#define _XENSTORE_INTERFACE_H_
+
+#include <windows.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <xeniface_batch.h>
+
+class XenIfaceItf
+{
+public:
+    XenIfaceItf() : m_generation(1)
+    {}
+    ~XenIfaceItf()
+    {
+        Lock    lock(Store().Mutex);
+
+        for (size_t i = 0; i < Store().Watches.size(); )
+            if (Store().Watches[i].Owner == this)
+                Store().Watches.erase(Store().Watches.begin() + i);
+            else
+                ++i;
+    }
+
+    String    Read(const String& path)
+    {
+        String      value;
+
+        ThrowIfFailed(TryRead(path, &value));
+        return value;
+    }
+    void      Write(const String& path, const String& value)
+    {
+        ThrowIfFailed(TryWrite(path, value));
+    }
+    void      Remove(const String& path)
+    {
+        ThrowIfFailed(TryRemove(path));
+    }
+    StringVct Directory(const String& path)
+    {
+        StringVct   values;
+
+        ThrowIfFailed(TryDirectory(path, &values));
+        return values;
+    }
+
+    HRESULT   TryRead(const String& path, String* value)
+    {
+        Lock        handle(m_mutex);
+        Delay();
+        Lock        lock(Store().Mutex);
+
+        ++Store().Reads;
+        std::map<String, String>::const_iterator it = Store().Values.find(path);
+        if (it == Store().Values.end())
+            return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+        *value = it->second;
+        return S_OK;
+    }
+    HRESULT   TryWrite(const String& path, const String& value)
+    {
+        Lock        handle(m_mutex);
+        Delay();
+        Lock        lock(Store().Mutex);
+
+        if (Store().Fail == path)
+            return HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
+        // as xenstore, missing parents are created empty, and stay
+        for (size_t slash = path.find('/'); slash != String::npos; slash = path.find('/', slash + 1))
+            Store().Values.insert(std::make_pair(path.substr(0, slash), String()));
+        Store().Values[path] = value;
+        Changed("write " + path + "=" + value, path);
+        return S_OK;
+    }
+    // removes path and everything under it; as xenstore, a missing path
+    // is only an error when its parent is missing too
+    HRESULT   TryRemove(const String& path)
+    {
+        Lock        handle(m_mutex);
+        Delay();
+        Lock        lock(Store().Mutex);
+        bool        found(false);
+
+        if (Store().Fail == path)
+            return HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
+        std::map<String, String>::iterator it = Store().Values.lower_bound(path);
+        while (it != Store().Values.end() && Under(it->first, path)) {
+            Store().Values.erase(it++);
+            found = true;
+        }
+        if (!found && Store().Values.count(path.substr(0, path.rfind('/'))) == 0)
+            return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+        Changed("remove " + path, path);
+        return S_OK;
+    }
+    HRESULT   TryDirectory(const String& path, StringVct* values)
+    {
+        Lock        handle(m_mutex);
+        Delay();
+        Lock        lock(Store().Mutex);
+        String      prefix = path + "/";
+
+        ++Store().Reads;
+        values->clear();
+        std::map<String, String>::const_iterator it = Store().Values.lower_bound(prefix);
+        for (; it != Store().Values.end() && it->first.compare(0, prefix.length(), prefix) == 0; ++it) {
+            String child = it->first.substr(prefix.length());
+            child = child.substr(0, child.find('/'));
+            if (std::find(values->begin(), values->end(), child) == values->end())
+                values->push_back(child);
+        }
+        if (values->empty())
+            return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+        return S_OK;
+    }
+    ULONG     Generation() const
+    {
+        return m_generation;
+    }
+    // as the real one, through the shared XenIfaceBatch::Apply
+    void      Flush(XenIfaceBatch& batch)
+    {
+        ThrowIfFailed(batch.Apply(*this));
+        batch.Clear();
+    }
+    // like xenstore, a new watch fires once straight away
+    PVOID     Watch(const String& path, HANDLE event)
+    {
+        Lock        lock(Store().Mutex);
+        WATCH       watch = { this, path, event, ++Store().Contexts };
+
+        if (!Store().CanWatch)
+            throw HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        Store().Watches.push_back(watch);
+        SetEvent(event);
+        return (PVOID)watch.Context;
+    }
+    void      Unwatch(PVOID context)
+    {
+        Lock        lock(Store().Mutex);
+
+        for (size_t i = 0; i < Store().Watches.size(); ++i) {
+            if (Store().Watches[i].Context == (size_t)context) {
+                Store().Watches.erase(Store().Watches.begin() + i);
+                return;
+            }
+        }
+        throw HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+    }
+
+    // test controls
+    //
+    // empties the store and resets everything below to its default
+    static void Reset()
+    {
+        Lock        lock(Store().Mutex);
+
+        Store().Values.clear();
+        Store().Watches.clear();
+        Store().Log.clear();
+        Store().Fail.clear();
+        Store().CanWatch = true;
+        Store().Reads = 0;
+        Store().Latency = 0;
+        Store().Throws = 0;
+    }
+    // every operation takes at least us microseconds, as a round trip
+    // through the ring to xenstored would
+    static void Latency(DWORD us)
+    {
+        Lock        lock(Store().Mutex);
+        Store().Latency = us;
+    }
+    // as an older xeniface, Watch fails and callers have to poll
+    static void CanWatch(bool can)
+    {
+        Lock        lock(Store().Mutex);
+        Store().CanWatch = can;
+    }
+    // writes and removes of exactly this path fail
+    static void FailOn(const String& path)
+    {
+        Lock        lock(Store().Mutex);
+        Store().Fail = path;
+    }
+    // every write and remove, in the order the store applied them
+    static StringVct Log()
+    {
+        Lock        lock(Store().Mutex);
+        return Store().Log;
+    }
+    static ULONG Reads()
+    {
+        Lock        lock(Store().Mutex);
+        return Store().Reads;
+    }
+    // failures thrown by Read, Write, Remove, Directory and Flush
+    static ULONG Throws()
+    {
+        Lock        lock(Store().Mutex);
+        return Store().Throws;
+    }
+    static size_t Watches()
+    {
+        Lock        lock(Store().Mutex);
+        return Store().Watches.size();
+    }
+    // waits up to timeout ms for path to hold value, as dom0 would see it
+    static bool WaitFor(const String& path, const String& value, DWORD timeout)
+    {
+        std::unique_lock<std::mutex> lock(Store().Mutex);
+
+        return Store().Changed.wait_for(lock, std::chrono::milliseconds(timeout), [&] {
+                    std::map<String, String>::const_iterator it = Store().Values.find(path);
+                    return it != Store().Values.end() && it->second == value;
+                });
+    }
+    // as the xeniface handle being reopened, its watches are lost
+    void      Reconnect()
+    {
+        Lock        lock(Store().Mutex);
+
+        ++m_generation;
+        for (size_t i = 0; i < Store().Watches.size(); )
+            if (Store().Watches[i].Owner == this)
+                Store().Watches.erase(Store().Watches.begin() + i);
+            else
+                ++i;
+    }
+
+private:
+    typedef std::lock_guard<std::mutex> Lock;
+
+    typedef struct _WATCH {
+        XenIfaceItf*    Owner;
+        String          Path;
+        HANDLE          Event;
+        size_t          Context;
+    } WATCH;
+
+    struct STORE {
+        STORE() : Contexts(0), CanWatch(true), Reads(0), Latency(0), Throws(0) {}
+
+        std::mutex                  Mutex;
+        std::condition_variable     Changed;
+        std::map<String, String>    Values;
+        std::vector<WATCH>          Watches;
+        size_t                      Contexts;
+        StringVct                   Log;
+        String                      Fail;
+        bool                        CanWatch;
+        ULONG                       Reads;
+        DWORD                       Latency;
+        ULONG                       Throws;
+    };
+
+    static STORE& Store()
+    {
+        static STORE    store;
+        return store;
+    }
+    static bool Under(const String& path, const String& parent)
+    {
+        return path.compare(0, parent.length(), parent) == 0 &&
+               (path.length() == parent.length() || path[parent.length()] == '/');
+    }
+    // fires watches on path, on its parents and on anything under it
+    void Changed(const String& entry, const String& path)
+    {
+        Store().Log.push_back(entry);
+        for (size_t i = 0; i < Store().Watches.size(); ++i)
+            if (Under(path, Store().Watches[i].Path) || Under(Store().Watches[i].Path, path))
+                SetEvent(Store().Watches[i].Event);
+        Store().Changed.notify_all();
+    }
+    void Delay()
+    {
+        DWORD       latency;
+        {
+            Lock    lock(Store().Mutex);
+            latency = Store().Latency;
+        }
+        if (latency)
+            usleep(latency);
+    }
+    void ThrowIfFailed(HRESULT hr)
+    {
+        if (FAILED(hr)) {
+            {
+                Lock    lock(Store().Mutex);
+                ++Store().Throws;
+            }
+            throw hr;
+        }
+    }
+
+    std::mutex      m_mutex;        // one operation at a time per handle
+    ULONG           m_generation;
+};
+
+#endif // _XENSTORE_INTERFACE_H_
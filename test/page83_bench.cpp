@@ -0,0 +1,269 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// cloning a LUN's identifiers from page 0x83: the original linear rescan of
+// the whole decoded page for every identifier, copied below from the
+// original provider.cpp, against __IndexPage83 and __CloneFromPage83, on
+// synthetic pages with up to 2048 descriptors. the identifiers looked up
+// are the last descriptors on the page, behind descriptors of other
+// associations, which is the rescan's worst case
+//
+// usage: page83_bench [LUNs per measurement, default 20000]
+
+#include <windows.h>
+#include <vdslun.h>
+#include <stats.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "bytes.h"
+#include "vpd.h"
+
+typedef vector<unsigned char> PAGE;
+
+void*
+CoTaskMemAlloc(
+    size_t                      size
+    )
+{
+    return malloc(size);
+}
+void
+CoTaskMemFree(
+    void*                       ptr
+    )
+{
+    free(ptr);
+}
+
+//=============================================================================
+// the original lookup
+
+static __inline void*
+Clone(
+    const void*                 Src,
+    size_t                      Len
+    )
+{
+    void* Dst;
+
+    Dst = (void*)::CoTaskMemAlloc(Len);
+    if (Dst) {
+        if (Src) {
+            memcpy(Dst, Src, Len);
+        } else {
+            memset(Dst, 0, Len);
+        }
+    } else {
+        throw E_OUTOFMEMORY;
+    }
+
+    return Dst;
+}
+static __inline bool
+__OldCloneFromPage83(
+    VDS_STORAGE_IDENTIFIER&     DstId,
+    const Bytes&                Page83
+    )
+{
+    for (size_t i = 4; i < Page83.Length(); ) {
+        const PVPD_IDENTIFICATION_DESCRIPTOR Desc = 
+                    (const PVPD_IDENTIFICATION_DESCRIPTOR)Page83.Ptr(i);
+
+        if (DstId.m_CodeSet == (VDS_STORAGE_IDENTIFIER_CODE_SET)Desc->CodeSet &&
+            DstId.m_Type == (VDS_STORAGE_IDENTIFIER_TYPE)Desc->Type && 
+            Desc->Association == 0) {
+
+            DstId.m_cbIdentifier    = Desc->Length;
+            DstId.m_rgbIdentifier   = (BYTE*)Clone(Desc->Identifier, Desc->Length);
+            return true;
+        }
+
+        i += (Desc->Length + 4);
+    }
+    return false;
+}
+
+//=============================================================================
+
+// keeps the optimizer from dropping a result
+static volatile size_t  Sink;
+
+static void
+Descriptor(
+    PAGE&                       Page,
+    unsigned char               CodeSet,
+    unsigned char               Type,
+    unsigned char               Association,
+    unsigned char               Fill
+    )
+{
+    Page.push_back(CodeSet);
+    Page.push_back((unsigned char)((Association << 4) | Type));
+    Page.push_back(0);
+    Page.push_back(16);
+    Page.insert(Page.end(), 16, Fill);
+}
+// Count descriptors, the last Wanted of them of association 0 and of
+// distinct code set and type, as the source LUN's identifiers ask for
+static string
+Page83(
+    size_t                      Count,
+    const vector<VDS_STORAGE_IDENTIFIER>& Wanted
+    )
+{
+    PAGE    Page(VPD_HEADER_LENGTH, 0);
+
+    Page[1] = 0x83;
+    for (size_t i = 0; i + Wanted.size() < Count; ++i)
+        Descriptor(Page, 1 + i % 3, i % 9, 1 + i % 2, (unsigned char)i);
+    for (size_t i = 0; i < Wanted.size(); ++i)
+        Descriptor(Page, (unsigned char)Wanted[i].m_CodeSet, (unsigned char)Wanted[i].m_Type, 0, 0xa0 + (unsigned char)i);
+
+    Page[2] = (unsigned char)((Page.size() - VPD_HEADER_LENGTH) >> 8);
+    Page[3] = (unsigned char)(Page.size() - VPD_HEADER_LENGTH);
+    return Bytes(&Page[0], Page.size()).ToBase64();
+}
+
+static void
+Free(
+    vector<VDS_STORAGE_IDENTIFIER>& Ids
+    )
+{
+    for (size_t i = 0; i < Ids.size(); ++i) {
+        CoTaskMemFree(Ids[i].m_rgbIdentifier);
+        Ids[i].m_rgbIdentifier = NULL;
+    }
+}
+// every identifier found, and holding its descriptor's fill
+static bool
+Check(
+    const vector<VDS_STORAGE_IDENTIFIER>& Ids
+    )
+{
+    for (size_t i = 0; i < Ids.size(); ++i) {
+        if (Ids[i].m_rgbIdentifier == NULL || Ids[i].m_cbIdentifier != 16 ||
+            Ids[i].m_rgbIdentifier[15] != 0xa0 + i)
+            return false;
+    }
+    return true;
+}
+
+// the page decoded whole for each LUN, as CloneLunInfo did, then rescanned
+// for each identifier
+static bool
+OldClone(
+    const string&               Base64,
+    vector<VDS_STORAGE_IDENTIFIER>& Ids
+    )
+{
+    Bytes   Page83(Base64);
+    bool    Found = true;
+
+    for (size_t i = 0; i < Ids.size(); ++i)
+        Found = __OldCloneFromPage83(Ids[i], Page83) && Found;
+    return Found;
+}
+// the page indexed, once per snapshot by the prefetch, then each identifier
+// decoded straight from base64
+static bool
+NewClone(
+    const PAGE83_INDEX&         Index,
+    const string&               Base64,
+    vector<VDS_STORAGE_IDENTIFIER>& Ids
+    )
+{
+    Base64View  Page83(Base64);
+    bool        Found = true;
+
+    for (size_t i = 0; i < Ids.size(); ++i)
+        Found = __CloneFromPage83(Ids[i], Index, Page83) && Found;
+    return Found;
+}
+
+int main(int argc, char** argv)
+{
+    static const size_t Counts[] = { 4, 16, 64, 256, 1024, 2048 };
+    size_t  Luns = argc > 1 ? atoi(argv[1]) : 20000;
+    int     Failures = 0;
+
+    // the identifiers of a typical source LUN
+    vector<VDS_STORAGE_IDENTIFIER> Ids(4);
+    memset(&Ids[0], 0, sizeof(Ids[0]) * Ids.size());
+    Ids[0].m_CodeSet = VDSStorageIdCodeSetBinary;   Ids[0].m_Type = VDSStorageIdTypeFCPHName;
+    Ids[1].m_CodeSet = VDSStorageIdCodeSetAscii;    Ids[1].m_Type = VDSStorageIdTypeVendorId;
+    Ids[2].m_CodeSet = VDSStorageIdCodeSetAscii;    Ids[2].m_Type = VDSStorageIdTypeVendorSpecific;
+    Ids[3].m_CodeSet = VDSStorageIdCodeSetBinary;   Ids[3].m_Type = VDSStorageIdTypeEUI64;
+
+    printf("%d identifiers per LUN, ns per LUN\n", (int)Ids.size());
+    printf("%12s %10s %10s %10s %10s %8s\n", "descriptors", "rescan", "index", "clone", "both", "speedup");
+    for (size_t c = 0; c < sizeof(Counts) / sizeof(Counts[0]); ++c) {
+        string          Base64 = Page83(Counts[c], Ids);
+        PAGE83_INDEX    Index;
+        size_t          Runs = max(Luns * 16 / Counts[c], (size_t)100);
+
+        if (!__IndexPage83(Base64View(Base64), Index))
+            ++Failures;
+        if (!OldClone(Base64, Ids) || !Check(Ids))
+            ++Failures;
+        Free(Ids);
+        if (!NewClone(Index, Base64, Ids) || !Check(Ids))
+            ++Failures;
+        Free(Ids);
+
+        ULONGLONG Start = StatsNow();
+        for (size_t Run = 0; Run < Runs; ++Run) {
+            Sink = OldClone(Base64, Ids);
+            Free(Ids);
+        }
+        double Rescan = (StatsNow() - Start) * 1000.0 / Runs;
+
+        Start = StatsNow();
+        for (size_t Run = 0; Run < Runs; ++Run) {
+            PAGE83_INDEX    Built;
+            Sink = __IndexPage83(Base64View(Base64), Built);
+        }
+        double Indexing = (StatsNow() - Start) * 1000.0 / Runs;
+
+        Start = StatsNow();
+        for (size_t Run = 0; Run < Runs; ++Run) {
+            Sink = NewClone(Index, Base64, Ids);
+            Free(Ids);
+        }
+        double Cloning = (StatsNow() - Start) * 1000.0 / Runs;
+
+        printf("%12u %10.0f %10.0f %10.0f %10.0f %7.1fx\n", (ULONG)Counts[c],
+               Rescan, Indexing, Cloning, Indexing + Cloning, Rescan / (Indexing + Cloning));
+    }
+    if (Failures)
+        printf("page83_bench: %d pages cloned wrongly\n", Failures);
+    return Failures;
+}
@@ -0,0 +1,133 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// ResolverPool against the in-memory store, every store operation taking
+// the given latency: the three reads that map a target id to its VDI, for
+// 1 to 64 LUNs, on the calling thread alone and shared with the helpers
+//
+// usage: resolve_bench [latency in us, default 1000]
+
+#include <windows.h>
+#include <debug.h>
+#include <stats.h>
+#include "resolvers.h"
+
+#include <stdlib.h>
+
+// XenVssProvider::MaxResolveThreads
+static const LONG Helpers = 7;
+
+static string Vdi(LONG index)
+{
+    char    vdi[64];
+
+    snprintf(vdi, sizeof(vdi), "00000000-0000-0000-0000-%012d", index);
+    return vdi;
+}
+
+// as dom0 lays out a VBD: target id => frontend => backend => vdi-uuid
+static void Populate(LONG count)
+{
+    XenIfaceItf store;
+    char        path[64];
+
+    for (LONG index = 0; index < count; ++index) {
+        snprintf(path, sizeof(path), "data/scsi/target/%d/frontend", index);
+        store.Write(path, "device/vbd/" + Vdi(index));
+        store.Write("device/vbd/" + Vdi(index) + "/backend", "backend/vbd/" + Vdi(index));
+        store.Write("backend/vbd/" + Vdi(index) + "/sm-data/vdi-uuid", Vdi(index));
+    }
+}
+
+// the reads of XenVssProvider::ResolveTarget
+static void ResolveOne(XenIfaceItf& store, LONG index, PVOID context)
+{
+    string* vdis = (string*)context;
+    char    path[64];
+
+    snprintf(path, sizeof(path), "data/scsi/target/%d/frontend", index);
+    string frontend = store.Read(path);
+    string backend = store.Read(frontend + "/backend");
+    vdis[index] = store.Read(backend + "/sm-data/vdi-uuid");
+}
+
+static int Check(const vector<string>& vdis)
+{
+    int     failures = 0;
+
+    for (size_t index = 0; index < vdis.size(); ++index)
+        if (vdis[index] != Vdi((LONG)index))
+            ++failures;
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    DWORD           latency = argc > 1 ? atoi(argv[1]) : 1000;
+    HANDLE          cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    ResolverPool*   pool = new ResolverPool(cancel, Helpers);
+    XenIfaceItf     store;
+    int             failures = 0;
+
+    Populate(64);
+    XenIfaceItf::Latency(latency);
+
+    // the provider keeps its helpers once started
+    vector<string>  warm(2);
+    pool->Run(store, 2, ResolveOne, &warm[0]);
+
+    printf("%d us per store operation, %d helpers\n", latency, Helpers);
+    printf("%6s %12s %12s %8s\n", "LUNs", "serial ms", "pool ms", "speedup");
+    for (LONG count = 1; count <= 64; count *= 2) {
+        vector<string>  serial(count);
+        vector<string>  pooled(count);
+
+        ULONGLONG start = StatsNow();
+        for (LONG index = 0; index < count; ++index)
+            ResolveOne(store, index, &serial[0]);
+        ULONGLONG serialUs = StatsNow() - start;
+
+        start = StatsNow();
+        pool->Run(store, count, ResolveOne, &pooled[0]);
+        ULONGLONG pooledUs = StatsNow() - start;
+
+        failures += Check(serial) + Check(pooled);
+        printf("%6d %12.1f %12.1f %7.1fx\n", count,
+               serialUs / 1000.0, pooledUs / 1000.0, (double)serialUs / pooledUs);
+    }
+
+    SetEvent(cancel);
+    delete pool;
+    CloseHandle(cancel);
+    if (failures)
+        printf("resolve_bench: %d LUNs resolved to the wrong VDI\n", failures);
+    return failures;
+}
@@ -0,0 +1,257 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// __SetWait against the in-memory store: a change to the status key must
+// wake the wait at once, well inside the 1 sec it otherwise sleeps, and a
+// staged request must reach the store before the status key dom0 acts on
+
+#include "test.h"
+#include <windows.h>
+// the stand-ins first, their guards keep out the ATL debug.h and stats.h
+// setwait.h would otherwise find beside it
+#include <debug.h>
+#include <stats.h>
+#include "setwait.h"
+
+#include <thread>
+
+static const SETWAIT_OP Create = { "create-snapshot", "snapshot-created", "snapshot-error", 10000 };
+static const string     Path = "vss/test";
+static const string     Status = Path + "/status";
+
+// dom0's side, answers the request after delay ms
+static std::thread Dom0(const char* reply, DWORD delay)
+{
+    return std::thread([=] {
+        XenIfaceItf dom0;
+        if (XenIfaceItf::WaitFor(Status, Create.set, 5000)) {
+            Sleep(delay);
+            dom0.Write(Status, reply);
+        }
+    });
+}
+
+static bool Removed(XenIfaceItf& itf, const string& path)
+{
+    string  value;
+    return FAILED(itf.TryRead(path, &value));
+}
+
+static void TestWatchWakes()
+{
+    XenIfaceItf itf;
+    HANDLE      cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    std::thread dom0 = Dom0(Create.pass, 50);
+
+    ULONGLONG start = StatsNow();
+    __SetWait(itf, Path, Create, cancel);
+    ULONG elapsed = StatsElapsed(start);
+    dom0.join();
+
+    CHECK(elapsed >= 50);
+    CHECK(elapsed < SETWAIT_POLL_MAX / 2);
+    CHECK(Removed(itf, Status));
+    CHECK(XenIfaceItf::Watches() == 0);
+    CloseHandle(cancel);
+}
+
+static void TestFail()
+{
+    XenIfaceItf itf;
+    HANDLE      cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    std::thread dom0 = Dom0(Create.fail, 0);
+
+    CHECK_HR(__SetWait(itf, Path, Create, cancel), E_FAIL);
+    dom0.join();
+
+    CHECK(Removed(itf, Status));
+    CloseHandle(cancel);
+}
+
+// older xeniface, no watches: polls from a fraction of the last latency
+static void TestPoll()
+{
+    XenIfaceItf itf;
+    HANDLE      cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    XenIfaceItf::CanWatch(false);
+    std::thread dom0 = Dom0(Create.pass, 50);
+
+    ULONGLONG start = StatsNow();
+    __SetWait(itf, Path, Create, cancel);
+    ULONG elapsed = StatsElapsed(start);
+    dom0.join();
+
+    CHECK(elapsed < SETWAIT_POLL_MAX / 2);
+    CHECK(Removed(itf, Status));
+    XenIfaceItf::CanWatch(true);
+    CloseHandle(cancel);
+}
+
+// an unanswered request is withdrawn
+static void TestTimeout()
+{
+    XenIfaceItf itf;
+    HANDLE      cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    SETWAIT_OP  op = Create;
+
+    op.timeout = 100;
+    CHECK_HR(__SetWait(itf, Path, op, cancel), XENVSS_E_TIMEOUT);
+    CHECK(Removed(itf, Status));
+    CHECK(XenIfaceItf::Watches() == 0);
+    CloseHandle(cancel);
+}
+
+static void TestCancel()
+{
+    XenIfaceItf itf;
+    HANDLE      cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    std::thread abort([=] {
+        if (XenIfaceItf::WaitFor(Status, Create.set, 5000)) {
+            Sleep(50);
+            SetEvent(cancel);
+        }
+    });
+
+    ULONGLONG start = StatsNow();
+    CHECK_HR(__SetWait(itf, Path, Create, cancel), XENVSS_E_CANCELLED);
+    ULONG elapsed = StatsElapsed(start);
+    abort.join();
+
+    CHECK(elapsed < SETWAIT_POLL_MAX / 2);
+    CHECK(Removed(itf, Status));
+    CloseHandle(cancel);
+}
+
+// the handle is reopened mid-wait: the watch is registered again on the new
+// one, and dom0's answer wakes the wait through it
+static void TestReconnect()
+{
+    XenIfaceItf itf;
+    HANDLE      cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    ULONGLONG   replied = 0;
+    std::thread dom0([&] {
+        XenIfaceItf dom0;
+        if (!XenIfaceItf::WaitFor(Status, Create.set, 5000))
+            return;
+        itf.Reconnect();
+        for (int i = 0; i < 1000 && XenIfaceItf::Watches() == 0; ++i)
+            Sleep(5);
+        replied = StatsNow();
+        dom0.Write(Status, Create.pass);
+    });
+
+    __SetWait(itf, Path, Create, cancel);
+    ULONGLONG done = StatsNow();
+    dom0.join();
+
+    CHECK(replied != 0);
+    CHECK(done >= replied);
+    CHECK((done - replied) / 1000 < SETWAIT_POLL_MAX / 2);
+    CHECK(XenIfaceItf::Watches() == 0);
+    CloseHandle(cancel);
+}
+
+// the request as EndPrepareSnapshots stages it, replacing a stale one
+static XenIfaceBatch Request()
+{
+    XenIfaceBatch   request;
+
+    request.Remove(Path + "/snapshot");
+    request.Write(Path + "/snapshot/a", "");
+    request.Write(Path + "/snapshot/b", "");
+    return request;
+}
+
+static void TestRequestOrder()
+{
+    XenIfaceItf     itf;
+    HANDLE          cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    XenIfaceBatch   request = Request();
+
+    XenIfaceItf::Reset();
+    itf.Write(Path + "/snapshot/stale", "");
+    std::thread dom0 = Dom0(Create.pass, 0);
+
+    __SetWait(itf, Path, Create, cancel, &request);
+    dom0.join();
+
+    StringVct log = XenIfaceItf::Log();
+    CHECK(log.size() == 7);
+    if (log.size() == 7) {
+        CHECK(log[0] == "write vss/test/snapshot/stale=");
+        CHECK(log[1] == "remove vss/test/snapshot");
+        CHECK(log[2] == "write vss/test/snapshot/a=");
+        CHECK(log[3] == "write vss/test/snapshot/b=");
+        CHECK(log[4] == "write vss/test/status=create-snapshot");
+        CHECK(log[5] == "write vss/test/status=snapshot-created");
+        CHECK(log[6] == "remove vss/test/status");
+    }
+    CHECK(request.Count() == 0);
+    CloseHandle(cancel);
+}
+
+// a request that does not reach the store in full is never started
+static void TestRequestFails()
+{
+    XenIfaceItf     itf;
+    HANDLE          cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+    XenIfaceBatch   request = Request();
+
+    XenIfaceItf::Reset();
+    itf.Write(Path + "/vdi", "");
+    XenIfaceItf::FailOn(Path + "/snapshot/a");
+    CHECK_HR(__SetWait(itf, Path, Create, cancel, &request),
+             HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED));
+
+    // the status write was queued last, and stayed queued
+    StringVct log = XenIfaceItf::Log();
+    CHECK(log.size() == 2);
+    CHECK(log.back() == "remove vss/test/snapshot");
+    CHECK(Removed(itf, Status));
+    CHECK(XenIfaceItf::Watches() == 0);
+    CHECK(request.Count() == 4);
+    XenIfaceItf::Reset();
+    CloseHandle(cancel);
+}
+
+int main()
+{
+    TestWatchWakes();
+    TestFail();
+    TestPoll();
+    TestTimeout();
+    TestCancel();
+    TestReconnect();
+    TestRequestOrder();
+    TestRequestFails();
+    return TestResult("setwait_test");
+}
@@ -0,0 +1,89 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// minimal checks for the host tests, each test program returns the number
+// of failed checks
+
+#ifndef _XENVSS_TEST_H_
+#define _XENVSS_TEST_H_
+
+#include <stdio.h>
+#include <string.h>
+
+static int __Failures = 0;
+
+#define CHECK(x)                                                    \
+    do {                                                            \
+        if (!(x)) {                                                 \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); \
+            ++__Failures;                                           \
+        }                                                           \
+    } while (0)
+
+// x must throw the const char* Bytes throws, with the given text
+#define CHECK_THROWS(x, what)                                       \
+    do {                                                            \
+        const char* __what = NULL;                                  \
+        try {                                                       \
+            x;                                                      \
+        } catch (const char* e) {                                   \
+            __what = e;                                             \
+        }                                                           \
+        if (__what == NULL || strcmp(__what, what) != 0) {          \
+            printf("%s:%d: %s threw \"%s\", expected \"%s\"\n",     \
+                   __FILE__, __LINE__, #x, __what ? __what : "nothing", what); \
+            ++__Failures;                                           \
+        }                                                           \
+    } while (0)
+
+// x must throw the HRESULT hr, as the provider's store code does
+#define CHECK_HR(x, hr)                                             \
+    do {                                                            \
+        HRESULT __hr = S_OK;                                        \
+        try {                                                       \
+            x;                                                      \
+        } catch (HRESULT e) {                                       \
+            __hr = e;                                               \
+        }                                                           \
+        if (__hr != (hr)) {                                         \
+            printf("%s:%d: %s threw %08x, expected %08x\n",        \
+                   __FILE__, __LINE__, #x, __hr, (HRESULT)(hr));    \
+            ++__Failures;                                           \
+        }                                                           \
+    } while (0)
+
+static int TestResult(const char* name)
+{
+    printf("%s: %s (%d failed)\n", name, __Failures ? "FAILED" : "passed", __Failures);
+    return __Failures;
+}
+
+#endif // _XENVSS_TEST_H_
@@ -0,0 +1,384 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+// VPD page parsing against truncated and inconsistent pages; every page is
+// copied into a heap buffer of exactly its length, so an out of bounds read
+// is reported by the address sanitizer, as is a page 0x83 identifier decoded
+// past the CoTaskMemAlloc buffer sized for it
+
+#include <windows.h>
+#include <vdslun.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "bytes.h"
+#include "vpd.h"
+#include "test.h"
+
+typedef vector<unsigned char> PAGE;
+
+static size_t   __Allocs = 0;
+static size_t   __Frees = 0;
+static size_t   __AllocSize = 0;
+
+void*
+CoTaskMemAlloc(
+    size_t                      size
+    )
+{
+    ++__Allocs;
+    __AllocSize = size;
+    return malloc(size);
+}
+void
+CoTaskMemFree(
+    void*                       ptr
+    )
+{
+    if (ptr == NULL)
+        return;
+    ++__Frees;
+    free(ptr);
+}
+
+static void
+Header(
+    PAGE&                       Page,
+    unsigned char               Code
+    )
+{
+    Page.push_back(0);      // direct access block device
+    Page.push_back(Code);
+    Page.push_back(0);
+    Page.push_back(0);
+}
+static void
+SetLength(
+    PAGE&                       Page,
+    size_t                      Length
+    )
+{
+    Page[2] = (unsigned char)(Length >> 8);
+    Page[3] = (unsigned char)Length;
+}
+static void
+Descriptor(
+    PAGE&                       Page,
+    unsigned char               CodeSet,
+    unsigned char               Type,
+    unsigned char               Association,
+    const char*                 Identifier,
+    size_t                      Length
+    )
+{
+    Page.push_back(CodeSet);
+    Page.push_back((unsigned char)((Association << 4) | Type));
+    Page.push_back(0);
+    Page.push_back((unsigned char)Length);
+    Page.insert(Page.end(), Identifier, Identifier + Length);
+}
+
+static bool
+SerialNumber(
+    const PAGE&                 Page,
+    size_t                      Length,
+    string*                     Serial
+    )
+{
+    unsigned char*  Buffer = new unsigned char[Length];
+    BytesView       View;
+    bool            Result;
+
+    memcpy(Buffer, Page.data(), Length);
+    Result = __VpdSerialNumber(BytesView(Buffer, Length), &View);
+    if (Result)
+        Serial->assign((const char*)View.Ptr(), View.Length());
+    delete[] Buffer;
+    return Result;
+}
+static bool
+Index(
+    const PAGE&                 Page,
+    size_t                      Length,
+    PAGE83_INDEX&               Index
+    )
+{
+    string  Base64 = Bytes(Page.data(), Length).ToBase64();
+
+    return __IndexPage83(Base64View(Base64), Index);
+}
+
+static void
+TestPage80()
+{
+    PAGE    Page;
+    string  Serial;
+
+    Header(Page, 0x80);
+    const char* Text = "  0123456789  ";
+    Page.insert(Page.end(), Text, Text + strlen(Text));
+    SetLength(Page, strlen(Text));
+
+    CHECK(SerialNumber(Page, Page.size(), &Serial));
+    CHECK(Serial == "  0123456789");
+
+    // shorter than the header, or than the header says
+    for (size_t Length = 0; Length < Page.size(); ++Length)
+        CHECK(!SerialNumber(Page, Length, &Serial));
+
+    SetLength(Page, 0x1000);
+    CHECK(!SerialNumber(Page, Page.size(), &Serial));
+    SetLength(Page, strlen(Text) + 1);
+    CHECK(!SerialNumber(Page, Page.size(), &Serial));
+
+    // bytes past the page length are not part of it
+    SetLength(Page, 6);
+    CHECK(SerialNumber(Page, Page.size(), &Serial));
+    CHECK(Serial == "  0123");
+    SetLength(Page, 0);
+    CHECK(SerialNumber(Page, Page.size(), &Serial));
+    CHECK(Serial.empty());
+}
+
+static PAGE
+Page83()
+{
+    PAGE    Page;
+
+    Header(Page, 0x83);
+    Descriptor(Page, 1, 3, 0, "\x60\x00\x00\x00\x12\x34\x56\x78", 8);
+    Descriptor(Page, 2, 1, 0, "XENSRC", 6);
+    Descriptor(Page, 2, 0, 0, "abcde", 5);
+    Descriptor(Page, 1, 3, 0, "\x11\x22\x33\x44\x55\x66\x77\x88", 8);
+    Descriptor(Page, 1, 3, 1, "\x50\x00\x00\x00\x00\x00\x00\x01", 8);
+    SetLength(Page, Page.size() - VPD_HEADER_LENGTH);
+    return Page;
+}
+
+static void
+TestPage83()
+{
+    PAGE            Page = Page83();
+    PAGE83_INDEX    Idx;
+
+    CHECK(Index(Page, Page.size(), Idx));
+    CHECK(Idx.size() == 4);
+
+    // the first of each kind, pointing at its identifier
+    PAGE83_INDEX::const_iterator it = Idx.find(__Page83Key(1, 3, 0));
+    CHECK(it != Idx.end());
+    CHECK(it->second.Offset == 8 && it->second.Length == 8);
+    it = Idx.find(__Page83Key(2, 0, 0));
+    CHECK(it != Idx.end());
+    CHECK(it->second.Offset == 30 && it->second.Length == 5);
+    CHECK(Idx.find(__Page83Key(1, 3, 1)) != Idx.end());
+
+    // bytes past the page length are not part of it
+    Page.push_back(0xff);
+    CHECK(Index(Page, Page.size(), Idx));
+    CHECK(Idx.size() == 4);
+    Page.pop_back();
+
+    // a page length of 0 holds no descriptors
+    SetLength(Page, 0);
+    CHECK(Index(Page, Page.size(), Idx));
+    CHECK(Idx.empty());
+}
+
+static void
+TestPage83Truncated()
+{
+    PAGE            Page = Page83();
+    PAGE83_INDEX    Idx;
+
+    // the buffer ends before the header says the page does
+    for (size_t Length = 0; Length < Page.size(); ++Length) {
+        Idx[0] = PAGE83_IDENTIFIER();
+        CHECK(!Index(Page, Length, Idx));
+        CHECK(Idx.empty());
+    }
+
+    SetLength(Page, 0xffff);
+    CHECK(!Index(Page, Page.size(), Idx));
+    CHECK(Idx.empty());
+
+    // the page length ends mid descriptor, only descriptor boundaries hold
+    size_t Boundaries[] = { 0, 12, 22, 31, 43, 55 };
+    size_t Boundary = 0;
+    for (size_t Length = 0; Length <= Page.size() - VPD_HEADER_LENGTH; ++Length) {
+        bool    Whole = Length == Boundaries[Boundary];
+
+        SetLength(Page, Length);
+        CHECK(Index(Page, Page.size(), Idx) == Whole);
+        CHECK(Whole || Idx.empty());
+        if (Whole)
+            ++Boundary;
+    }
+    CHECK(Boundary == sizeof(Boundaries) / sizeof(Boundaries[0]));
+}
+
+static void
+TestPage83Overrun()
+{
+    PAGE            Page = Page83();
+    PAGE83_INDEX    Idx;
+
+    // the last descriptor claims one byte more than the page holds
+    Page[VPD_HEADER_LENGTH + 43 + 3] = 9;
+    CHECK(!Index(Page, Page.size(), Idx));
+    CHECK(Idx.empty());
+
+    // the first descriptor claims the most it can
+    Page = Page83();
+    Page[VPD_HEADER_LENGTH + 3] = 0xff;
+    CHECK(!Index(Page, Page.size(), Idx));
+    CHECK(Idx.empty());
+
+    // a lone descriptor header with its identifier missing
+    Page.clear();
+    Header(Page, 0x83);
+    Descriptor(Page, 1, 3, 0, "", 0);
+    Page[VPD_HEADER_LENGTH + 3] = 8;
+    SetLength(Page, Page.size() - VPD_HEADER_LENGTH);
+    CHECK(!Index(Page, Page.size(), Idx));
+    CHECK(Idx.empty());
+}
+
+// clones the identifier of the given kind, checking it took one allocation
+// of exactly its length and holds the expected bytes
+static bool
+Clone(
+    const string&               Base64,
+    const PAGE83_INDEX&         Idx,
+    ULONG                       CodeSet,
+    ULONG                       Type,
+    const char*                 Expected,
+    size_t                      Length
+    )
+{
+    VDS_STORAGE_IDENTIFIER  Id;
+    size_t                  Allocs = __Allocs;
+    size_t                  Frees = __Frees;
+    bool                    Result;
+
+    memset(&Id, 0, sizeof(Id));
+    Id.m_CodeSet = (VDS_STORAGE_IDENTIFIER_CODE_SET)CodeSet;
+    Id.m_Type = (VDS_STORAGE_IDENTIFIER_TYPE)Type;
+
+    Result = __CloneFromPage83(Id, Idx, Base64View(Base64));
+    if (!Result) {
+        CHECK(Id.m_rgbIdentifier == NULL && Id.m_cbIdentifier == 0);
+        CHECK(__Allocs - Allocs == __Frees - Frees);
+        return false;
+    }
+
+    CHECK(__Allocs == Allocs + 1);
+    CHECK(__AllocSize == Length);
+    CHECK(Id.m_cbIdentifier == Length);
+    CHECK(memcmp(Id.m_rgbIdentifier, Expected, Length) == 0);
+    CoTaskMemFree(Id.m_rgbIdentifier);
+    return true;
+}
+
+static void
+TestClone()
+{
+    PAGE            Page = Page83();
+    string          Base64 = Bytes(Page.data(), Page.size()).ToBase64();
+    PAGE83_INDEX    Idx;
+    size_t          Allocs;
+
+    CHECK(__IndexPage83(Base64View(Base64), Idx));
+
+    // the first binary NAA identifier, not the later one or the port's
+    CHECK(Clone(Base64, Idx, VDSStorageIdCodeSetBinary, VDSStorageIdTypeFCPHName,
+                "\x60\x00\x00\x00\x12\x34\x56\x78", 8));
+    CHECK(Clone(Base64, Idx, VDSStorageIdCodeSetAscii, VDSStorageIdTypeVendorId,
+                "XENSRC", 6));
+    CHECK(Clone(Base64, Idx, VDSStorageIdCodeSetAscii, VDSStorageIdTypeVendorSpecific,
+                "abcde", 5));
+
+    // nothing of that kind allocates nothing
+    Allocs = __Allocs;
+    CHECK(!Clone(Base64, Idx, VDSStorageIdCodeSetBinary, VDSStorageIdTypeEUI64, "", 0));
+    CHECK(__Allocs == Allocs);
+
+    // an index that outlived its page frees the buffer it decoded into
+    string  Short = Bytes(Page.data(), 12).ToBase64();
+    Allocs = __Allocs;
+    CHECK(!Clone(Short, Idx, VDSStorageIdCodeSetBinary, VDSStorageIdTypeFCPHName, "", 0));
+    CHECK(__Allocs == Allocs + 1);
+    CHECK(__Frees == __Allocs);
+
+    // a page whose last descriptor is truncated has no identifiers to clone
+    SetLength(Page, 40);
+    Base64 = Bytes(Page.data(), Page.size()).ToBase64();
+    CHECK(!__IndexPage83(Base64View(Base64), Idx));
+    Allocs = __Allocs;
+    CHECK(!Clone(Base64, Idx, VDSStorageIdCodeSetBinary, VDSStorageIdTypeFCPHName, "", 0));
+    CHECK(__Allocs == Allocs);
+}
+
+// odd length identifiers at every offset within a base64 quad
+static void
+TestCloneOdd()
+{
+    const char* Text = "0123456789abcdefg";
+
+    for (size_t Pad = 0; Pad < 3; ++Pad) {
+        for (size_t Length = 1; Length < 17; Length += 2) {
+            PAGE            Page;
+            PAGE83_INDEX    Idx;
+
+            Header(Page, 0x83);
+            Descriptor(Page, 1, 0, 0, "\xff\xff", Pad);
+            Descriptor(Page, 2, 8, 0, Text, Length);
+            SetLength(Page, Page.size() - VPD_HEADER_LENGTH);
+
+            string  Base64 = Bytes(Page.data(), Page.size()).ToBase64();
+            CHECK(__IndexPage83(Base64View(Base64), Idx));
+            CHECK(Clone(Base64, Idx, VDSStorageIdCodeSetAscii, VDSStorageIdTypeScsiNameString,
+                        Text, Length));
+        }
+    }
+}
+
+int
+main()
+{
+    TestPage80();
+    TestPage83();
+    TestPage83Truncated();
+    TestPage83Overrun();
+    TestClone();
+    TestCloneOdd();
+    return TestResult("vpd_test");
+}